@@ -3,684 +3,6358 @@
 #include <vector>
 #include <cmath>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <charconv>
+#include <string_view>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <sstream>
 
-const int BOARD_WIDTH = 80;
-const int BOARD_HEIGHT = 80;
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SHAPES_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(SHAPES_X86) && !defined(_MSC_VER)
+#define SHAPES_TARGET_AVX2 __attribute__((target("avx2")))
+#define SHAPES_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define SHAPES_TARGET_AVX2
+#define SHAPES_TARGET_SSE2
+#endif
+
+const int DEFAULT_BOARD_WIDTH = 80;
+const int DEFAULT_BOARD_HEIGHT = 80;
 const int FIGURE_SCALE = 2;
+const int ROW_ALIGNMENT = 64;
+const int INDEX_CELL_SIZE = 32;
+const size_t MAX_INDEX_BUCKETS = 1 << 20;
+const int BOARD_TILE_SIZE = 64;
+const long long TILED_BOARD_MIN_CELLS = 1LL << 26;
+// Multiple of ROW_ALIGNMENT, so neighbouring render tiles never write to the same cache line, and
+// of BOARD_TILE_SIZE, so they never allocate the same board tile either.
+const int RENDER_TILE_SIZE = 128;
+// Render pools get at most this many threads per hardware thread.
+const int MAX_THREADS_PER_CORE = 4;
+const char TRANSPARENT_CELL = '\0';
+const char BACKGROUND_CELL = '\1';
+const char UNKNOWN_COLOR = '\2';
+const int FIRST_NAMED_COLOR = 3;
+const char SCENE_FILE_MAGIC[4] = { 'S', 'H', 'P', 'B' };
+const uint32_t SCENE_FILE_VERSION = 3;
+const size_t SCENE_HEADER_SIZE = 32;
+const size_t SCENE_RECORD_SIZE = 28;
+const size_t SCENE_RECORD_SIZE_V1 = 24;
+const size_t MAX_LAYER_NAME = 255;
+// Scenes keep per-id tables sized by the largest id, so ids, including those read from files,
+// stay at or below this.
+const int MAX_SHAPE_ID = (1 << 24) - 1;
+// Boards, including those read from files, are at most this many cells on a side. It keeps cell
+// and index arithmetic inside an int and a tiled board's tile table near 128 MiB.
+const int MAX_BOARD_SIDE = 1 << 18;
+// Owner of a cell no shape has painted. Not 0, which is a valid shape id.
+const int NO_OWNER = -1;
+const size_t TEXT_LOAD_CHUNK = 1 << 20;
+const size_t PRINT_CHUNK = 1 << 20;
+const size_t DEFAULT_HISTORY_KIB = 64 * 1024;
+const char LOG_FILE_MAGIC[4] = { 'S', 'H', 'P', 'L' };
+const uint32_t LOG_FILE_VERSION = 2;
+const size_t LOG_HEADER_SIZE = 8;
+const size_t LOG_FRAME_SIZE = 12;
+const size_t DEFAULT_LOG_COMPACT = 10000;
+const uint64_t MIN_LOG_COMPACT_BYTES = 1 << 20;
 
-struct Board {
-    std::vector<std::vector<char>> grid;
-    Board() : grid(BOARD_HEIGHT, std::vector<char>(BOARD_WIDTH, ' ')) {}
+// Every heap allocation in the program goes through the replacements below, so --bench can
+// report how many allocations each phase makes.
+struct AllocationCounters {
+    std::atomic<uint64_t> allocations{ 0 };
+    std::atomic<uint64_t> frees{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+};
 
-    void print() {
-        for (auto& row : grid) {
-            for (char c : row) {
-                std::cout << c;
-            }
-            std::cout << "\n";
+AllocationCounters allocation_counters;
+
+inline void CountAllocation(std::size_t size) {
+    allocation_counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    allocation_counters.bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+inline void CountFree(void* p) {
+    if (p) allocation_counters.frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+    CountAllocation(size);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    CountAllocation(size);
+    std::size_t align = static_cast<std::size_t>(alignment);
+#ifdef _WIN32
+    void* p = _aligned_malloc(size ? size : 1, align);
+#else
+    void* p = std::aligned_alloc(align, (size + align - 1) / align * align);
+#endif
+    if (p) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return ::operator new(size, alignment);
+}
+
+void operator delete(void* p) noexcept {
+    CountFree(p);
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    ::operator delete(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    ::operator delete(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    CountFree(p);
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+void operator delete[](void* p, std::align_val_t alignment) noexcept {
+    ::operator delete(p, alignment);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept {
+    ::operator delete(p, alignment);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t alignment) noexcept {
+    ::operator delete(p, alignment);
+}
+
+// Hot-path instrumentation. Building with SHAPES_NO_STATS defined turns every SHAPES_STAT_*
+// macro into nothing, so the counters cost nothing when they are not wanted.
+#ifndef SHAPES_NO_STATS
+#define SHAPES_STATS 1
+#endif
+
+// Latency histogram with four sub-buckets per power of two, so percentiles are within 25%.
+// Updates are relaxed atomics and safe from render threads.
+struct LatencyHistogram {
+    static const int BUCKETS = 256;
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total{ 0 };
+    std::atomic<uint64_t> max_ns{ 0 };
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < 4) return static_cast<int>(ns);
+        int exponent = 63;
+        while (!(ns >> exponent)) --exponent;
+        return 4 * (exponent - 1) + static_cast<int>((ns >> (exponent - 2)) & 3);
+    }
+
+    // Largest value that lands in the bucket.
+    static uint64_t bucketLimit(int bucket) {
+        if (bucket < 4) return bucket;
+        int exponent = bucket / 4 + 1;
+        uint64_t sub = bucket % 4;
+        return ((5 + sub) << (exponent - 2)) - 1;
+    }
+
+    void record(uint64_t ns) {
+        counts[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = max_ns.load(std::memory_order_relaxed);
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+
+    uint64_t percentile(double fraction) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(fraction * (n - 1)) + 1;
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += counts[bucket].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(bucketLimit(bucket), max_ns.load(std::memory_order_relaxed));
         }
+        return max_ns.load(std::memory_order_relaxed);
     }
+};
 
-    void clear() {
-        grid.assign(BOARD_HEIGHT, std::vector<char>(BOARD_WIDTH, ' '));
+const int SHAPE_KIND_COUNT = 4;
+
+struct RenderStats {
+    std::atomic<uint64_t> shapes_drawn[SHAPE_KIND_COUNT] = {};
+    std::atomic<uint64_t> kind_cells[SHAPE_KIND_COUNT] = {};
+    std::atomic<uint64_t> cells_written{ 0 };
+    LatencyHistogram full_redraw;
+    LatencyHistogram region_redraw;
+    LatencyHistogram composite;
+    LatencyHistogram save;
+    LatencyHistogram load;
+    LatencyHistogram snapshot;  // copying the scene for a background save
+    LatencyHistogram log_commit;    // writing and syncing one group of log records
+    LatencyHistogram checkpoint;    // compacting the log
+};
+
+RenderStats render_stats;
+
+inline uint64_t ElapsedNs(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Records the lifetime of the enclosing scope into a histogram.
+struct ScopedLatency {
+    LatencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+
+    explicit ScopedLatency(LatencyHistogram& target) : histogram(target), start(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() { histogram.record(ElapsedNs(start)); }
+};
+
+#define SHAPES_STAT_JOIN2(a, b) a##b
+#define SHAPES_STAT_JOIN(a, b) SHAPES_STAT_JOIN2(a, b)
+#ifdef SHAPES_STATS
+#define SHAPES_STAT_TIME(histogram) ScopedLatency SHAPES_STAT_JOIN(stat_scope_, __LINE__)(histogram)
+#define SHAPES_STAT_SCOPE(type, ...) type SHAPES_STAT_JOIN(stat_scope_, __LINE__)(__VA_ARGS__)
+#else
+#define SHAPES_STAT_TIME(histogram)
+#define SHAPES_STAT_SCOPE(type, ...)
+#endif
+
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
     }
+
+    void deallocate(T* p, std::size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
 };
 
-struct Information {
-    int id;
-    std::string type;
-    int x, y;
-    int width, height;
-    char outline;
-    char fill;
+void FillBytesScalar(char* dst, size_t count, char c) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = c;
+    }
+}
+
+#ifdef SHAPES_X86
+SHAPES_TARGET_SSE2 void FillBytesSse2(char* dst, size_t count, char c) {
+    __m128i value = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), value);
+    }
+    if (i < count && count >= 16) {
+        // Finish with one overlapping store instead of a byte loop.
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + count - 16), value);
+        return;
+    }
+    for (; i < count; ++i) {
+        dst[i] = c;
+    }
+}
+
+SHAPES_TARGET_AVX2 void FillBytesAvx2(char* dst, size_t count, char c) {
+    if (count < 32) {
+        FillBytesSse2(dst, count, c);
+        return;
+    }
+    __m256i value = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), value);
+    }
+    if (i < count) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + count - 32), value);
+    }
+}
+
+bool CpuHasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) return false;
+    // The OS must save the upper halves of the ymm registers.
+    if ((_xgetbv(0) & 0x6) != 0x6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+using FillBytesFn = void (*)(char*, size_t, char);
+
+// Picked once at startup from what the CPU supports.
+FillBytesFn SelectFillBytes() {
+#ifdef SHAPES_X86
+    if (CpuHasAvx2()) return FillBytesAvx2;
+    return FillBytesSse2;
+#else
+    return FillBytesScalar;
+#endif
+}
 
-    Information(int id, std::string type, int x, int y, int dim1, int dim2 = 0, char outline = '*', char fill = ' ')
-        : id(id), type(type), x(x), y(y), width(dim1), height(dim2), outline(outline), fill(fill) {}
+const FillBytesFn FillBytes = SelectFillBytes();
+
+// Half-open cell rectangle [x0, x1) x [y0, y1).
+struct Rect {
+    int x0, y0, x1, y1;
+
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+
+    bool intersects(const Rect& other) const {
+        return x0 < other.x1 && other.x0 < x1 && y0 < other.y1 && other.y0 < y1;
+    }
+
+    Rect intersected(const Rect& other) const {
+        return { std::max(x0, other.x0), std::max(y0, other.y0), std::min(x1, other.x1), std::min(y1, other.y1) };
+    }
+
+    Rect united(const Rect& other) const {
+        if (empty()) return other;
+        if (other.empty()) return *this;
+        return { std::min(x0, other.x0), std::min(y0, other.y0), std::max(x1, other.x1), std::max(y1, other.y1) };
+    }
 };
 
-struct Shape {
-    virtual void draw(Board& board, int x, int y, char outlineColor, char fillColor, bool fillInside = false) = 0;
-    virtual ~Shape() = default;
-    virtual bool Fits(int x, int y) = 0;
-    virtual bool Duplicate(const Information& info) = 0;
+// How boards store their cells. --storage picks one for every board; by default boards with more
+// than TILED_BOARD_MIN_CELLS cells are tiled.
+enum class StorageMode { Auto, Dense, Tiled };
+
+StorageMode storage_mode = StorageMode::Auto;
+
+bool ValidBoardSize(int width, int height) {
+    return width > 0 && height > 0 && width <= MAX_BOARD_SIDE && height <= MAX_BOARD_SIDE;
+}
+
+bool UseTiledStorage(int width, int height) {
+    if (storage_mode != StorageMode::Auto) return storage_mode == StorageMode::Tiled;
+    return static_cast<long long>(width) * height > TILED_BOARD_MIN_CELLS;
+}
+
+// Cells, and the outline and fill of a shape, hold a colour as a one-byte index into the palette.
+// Only printing decides what an index looks like: its glyph in plain output, the glyph in its RGB
+// colour in ANSI mode. Index 0 is TRANSPARENT_CELL, 1 BACKGROUND_CELL and 2 UNKNOWN_COLOR, the
+// mark a colour name that was not understood leaves. The named colours follow, then a 6x6x6 cube
+// of RGB levels and a grey ramp, which fill the rest of the byte and which #rrggbb snaps to.
+struct PaletteEntry {
+    const char* name;   // nullptr for the cube and the ramp
+    char glyph;
+    unsigned char r, g, b;
 };
 
-struct Circle : public Shape {
-    int radius;
+struct Palette {
+    PaletteEntry entries[256];
+    char glyphs[256];               // entries[i].glyph, packed for printing
+    char from_glyph[256];           // the index a glyph stands for, for files that stored glyphs
+    int named_end = FIRST_NAMED_COLOR;
 
-    Circle(int r) : radius(r) {}
+    Palette() {
+        static const PaletteEntry fixed[] = {
+            { nullptr, ' ', 0, 0, 0 }, { nullptr, ' ', 0, 0, 0 }, { nullptr, '*', 0, 0, 0 },
+            { "red", 'R', 255, 0, 0 }, { "green", 'G', 0, 192, 0 }, { "blue", 'B', 0, 0, 255 },
+            { "yellow", 'Y', 255, 255, 0 }, { "cyan", 'C', 0, 255, 255 }, { "magenta", 'M', 255, 0, 255 },
+            { "white", 'W', 255, 255, 255 }, { "black", 'K', 0, 0, 0 }, { "orange", 'O', 255, 165, 0 },
+            { "purple", 'P', 128, 0, 128 }, { "pink", 'I', 255, 192, 203 }, { "brown", 'N', 165, 42, 42 },
+            { "gray", 'A', 128, 128, 128 },
+        };
+        const unsigned char levels[] = { 0, 95, 135, 175, 215, 255 };
 
-    void draw(Board& board, int X, int Y, char outline, char fill, bool fillInside = false) override {
-        if (radius <= 0) return;
+        int count = 0;
+        for (const PaletteEntry& entry : fixed) entries[count++] = entry;
+        named_end = count;
+        for (unsigned char r : levels) {
+            for (unsigned char g : levels) {
+                for (unsigned char b : levels) entries[count++] = { nullptr, nearestGlyph(r, g, b), r, g, b };
+            }
+        }
+        while (count < 256) {
+            unsigned char grey = static_cast<unsigned char>(8 + 10 * (count - named_end - 216));
+            entries[count++] = { nullptr, nearestGlyph(grey, grey, grey), grey, grey, grey };
+        }
 
-        for (int y = -radius; y <= radius; ++y) {
-            for (int x = -radius; x <= radius; ++x) {
-                float correctY = y * FIGURE_SCALE;
-                float distance = sqrt(x * x + correctY * correctY);
-                if (std::abs(distance - radius) <= 0.5) {
-                    int drawnX = X + x;
-                    int drawnY = Y + y;
-                    if (drawnX >= 0 && drawnX < BOARD_WIDTH && drawnY >= 0 && drawnY < BOARD_HEIGHT) {
-                        board.grid[drawnY][drawnX] = outline;
-                    }
-                }
-                else if (fillInside && distance < radius) {
-                    int drawnX = X + x;
-                    int drawnY = Y + y;
-                    if (drawnX >= 0 && drawnX < BOARD_WIDTH && drawnY >= 0 && drawnY < BOARD_HEIGHT) {
-                        board.grid[drawnY][drawnX] = fill;
-                    }
-                }
+        std::memset(from_glyph, UNKNOWN_COLOR, sizeof(from_glyph));
+        from_glyph[static_cast<unsigned char>(' ')] = BACKGROUND_CELL;
+        for (int i = 0; i < 256; ++i) {
+            glyphs[i] = entries[i].glyph;
+            if (i >= FIRST_NAMED_COLOR && i < named_end) from_glyph[static_cast<unsigned char>(entries[i].glyph)] = static_cast<char>(i);
+        }
+    }
+
+    // The index of the colour closest to r, g, b, preferring named colours on a tie.
+    char nearest(int r, int g, int b) const {
+        int best = FIRST_NAMED_COLOR;
+        long best_distance = -1;
+        for (int i = FIRST_NAMED_COLOR; i < 256; ++i) {
+            long dr = entries[i].r - r, dg = entries[i].g - g, db = entries[i].b - b;
+            long distance = dr * dr + dg * dg + db * db;
+            if (best_distance < 0 || distance < best_distance) {
+                best = i;
+                best_distance = distance;
+            }
+        }
+        return static_cast<char>(best);
+    }
+
+private:
+    // Glyphs are letters of the named colours, so a cube colour prints as the nearest of those.
+    char nearestGlyph(int r, int g, int b) const {
+        char glyph = '*';
+        long best_distance = -1;
+        for (int i = FIRST_NAMED_COLOR; i < named_end; ++i) {
+            long dr = entries[i].r - r, dg = entries[i].g - g, db = entries[i].b - b;
+            long distance = dr * dr + dg * dg + db * db;
+            if (best_distance < 0 || distance < best_distance) {
+                glyph = entries[i].glyph;
+                best_distance = distance;
+            }
+        }
+        return glyph;
+    }
+};
+
+const Palette palette;
+
+inline const PaletteEntry& ColorEntry(char color) {
+    return palette.entries[static_cast<unsigned char>(color)];
+}
+
+// Turns a run of cells into the glyphs that show them.
+inline void ToGlyphs(char* cells, size_t count) {
+    for (size_t i = 0; i < count; ++i) cells[i] = palette.glyphs[static_cast<unsigned char>(cells[i])];
+}
+
+// A colour as listings and text files write it: the glyph of a named colour, #rrggbb otherwise.
+std::string ColorLabel(char color) {
+    if (static_cast<unsigned char>(color) < palette.named_end) return std::string(1, ColorEntry(color).glyph);
+    const PaletteEntry& entry = ColorEntry(color);
+    char label[8];
+    std::snprintf(label, sizeof(label), "#%02x%02x%02x", entry.r, entry.g, entry.b);
+    return label;
+}
+
+// Reads "#rrggbb" into the nearest palette colour. Returns false if text is not one.
+bool ParseHexColor(std::string_view text, char& color) {
+    if (text.size() != 7 || text[0] != '#') return false;
+    unsigned int value = 0;
+    std::from_chars_result result = std::from_chars(text.data() + 1, text.data() + text.size(), value, 16);
+    if (result.ec != std::errc() || result.ptr != text.data() + text.size()) return false;
+    color = palette.nearest((value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF);
+    return true;
+}
+
+// The reverse of ColorLabel. Glyphs no colour uses read as UNKNOWN_COLOR, as in files written
+// before colours went beyond red, green and blue.
+bool ParseColorLabel(std::string_view text, char& color) {
+    if (text.size() == 1) {
+        color = palette.from_glyph[static_cast<unsigned char>(text[0])];
+        return true;
+    }
+    return ParseHexColor(text, color);
+}
+
+// Cleared cells hold background: BACKGROUND_CELL for the board that is printed, TRANSPARENT_CELL for
+// layer caches. Dense boards are one buffer with every row on a ROW_ALIGNMENT boundary. Tiled
+// boards are a grid of BOARD_TILE_SIZE squares, each allocated the first time a cell in it is
+// set to something other than background, so memory follows the painted area instead of the
+// board size. Everything outside this struct reaches the cells through set/fill and the span
+// accessors, which work for both.
+struct Board {
+    int width;
+    int height;
+    char background;
+    bool tiled;
+
+    int stride = 0;
+    std::vector<char, AlignedAllocator<char, ROW_ALIGNMENT>> cells;
+
+    int tile_cols = 0;
+    std::vector<std::unique_ptr<char[]>> tiles;
+
+    // Optional, dense boards only: a second plane beside cells holding, per cell, the id of the
+    // shape that painted it last, or NO_OWNER. Laid out like cells. Canvases keep it up to date as they draw, and clearing resets it.
+    std::vector<int> owners;
+
+    Board(int w = DEFAULT_BOARD_WIDTH, int h = DEFAULT_BOARD_HEIGHT, char background = BACKGROUND_CELL, bool tiled_storage = false)
+        : width(w), height(h), background(background), tiled(tiled_storage || UseTiledStorage(w, h)) {
+        if (tiled) {
+            tile_cols = (w + BOARD_TILE_SIZE - 1) / BOARD_TILE_SIZE;
+            tiles.resize(static_cast<size_t>(tile_cols) * ((h + BOARD_TILE_SIZE - 1) / BOARD_TILE_SIZE));
+        }
+        else {
+            stride = (w + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+            cells.assign(static_cast<size_t>(stride) * h, background);
+        }
+    }
+
+    Rect bounds() const { return { 0, 0, width, height }; }
+
+    bool contains(int x, int y) const {
+        return x >= 0 && x < width && y >= 0 && y < height;
+    }
+
+    // Dense boards only.
+    char* row(int y) { return cells.data() + static_cast<size_t>(y) * stride; }
+    const char* row(int y) const { return cells.data() + static_cast<size_t>(y) * stride; }
+    int* ownerRow(int y) { return owners.data() + static_cast<size_t>(y) * stride; }
+
+    // Starts or stops keeping owners. A new plane says NO_OWNER everywhere until the board is redrawn.
+    void trackOwners(bool on) {
+        if (!on || tiled) std::vector<int>().swap(owners);
+        else if (owners.empty()) owners.assign(cells.size(), NO_OWNER);
+    }
+
+    int ownerAt(int x, int y) const {
+        return owners.empty() ? NO_OWNER : owners[static_cast<size_t>(y) * stride + x];
+    }
+
+    // Bytes held for cells. Tiles are counted here rather than as they are allocated, because
+    // tiled redraws allocate them from several threads at once.
+    size_t bytes() const {
+        if (!tiled) return cells.size();
+        size_t used = std::count_if(tiles.begin(), tiles.end(), [](const std::unique_ptr<char[]>& tile) { return tile != nullptr; });
+        return tiles.size() * sizeof(tiles[0]) + used * BOARD_TILE_SIZE * BOARD_TILE_SIZE;
+    }
+
+    // The cells of row y from x to the end of the row, or of x's tile when tiled. Returns them
+    // and their count in length, or nullptr if they are all background because the tile was
+    // never allocated.
+    const char* span(int x, int y, int& length) const {
+        if (!tiled) {
+            length = width - x;
+            return row(y) + x;
+        }
+        int tile_x = x / BOARD_TILE_SIZE;
+        length = std::min(width, (tile_x + 1) * BOARD_TILE_SIZE) - x;
+        const char* tile = tiles[static_cast<size_t>(y / BOARD_TILE_SIZE) * tile_cols + tile_x].get();
+        return tile ? tile + (y % BOARD_TILE_SIZE) * BOARD_TILE_SIZE + x % BOARD_TILE_SIZE : nullptr;
+    }
+
+    // The same span, allocating its tile if needed.
+    char* writableSpan(int x, int y, int& length) {
+        if (!tiled) {
+            length = width - x;
+            return row(y) + x;
+        }
+        int tile_x = x / BOARD_TILE_SIZE;
+        length = std::min(width, (tile_x + 1) * BOARD_TILE_SIZE) - x;
+        std::unique_ptr<char[]>& tile = tiles[static_cast<size_t>(y / BOARD_TILE_SIZE) * tile_cols + tile_x];
+        if (!tile) {
+            tile.reset(new char[BOARD_TILE_SIZE * BOARD_TILE_SIZE]);
+            std::memset(tile.get(), background, BOARD_TILE_SIZE * BOARD_TILE_SIZE);
+        }
+        return tile.get() + (y % BOARD_TILE_SIZE) * BOARD_TILE_SIZE + x % BOARD_TILE_SIZE;
+    }
+
+    char at(int x, int y) const {
+        int length;
+        const char* cells_span = span(x, y, length);
+        return cells_span ? *cells_span : background;
+    }
+
+    void set(int x, int y, char c) {
+        if (!tiled) {
+            row(y)[x] = c;
+            return;
+        }
+        int length;
+        if (c != background) *writableSpan(x, y, length) = c;
+        else if (char* cell = const_cast<char*>(span(x, y, length))) *cell = c;
+    }
+
+    // Sets [x0, x1) of row y, which must lie on the board, to c.
+    void fill(int y, int x0, int x1, char c) {
+        if (!tiled) {
+            FillBytes(row(y) + x0, static_cast<size_t>(x1 - x0), c);
+            return;
+        }
+        for (int x = x0; x < x1;) {
+            int length;
+            char* out = c != background ? writableSpan(x, y, length) : const_cast<char*>(span(x, y, length));
+            length = std::min(length, x1 - x);
+            if (out) FillBytes(out, static_cast<size_t>(length), c);
+            x += length;
+        }
+    }
+
+    // Copies [x0, x1) of row y into out.
+    void readRow(int y, int x0, int x1, char* out) const {
+        for (int x = x0; x < x1;) {
+            int length;
+            const char* in = span(x, y, length);
+            length = std::min(length, x1 - x);
+            if (in) std::memcpy(out, in, length);
+            else std::memset(out, background, length);
+            out += length;
+            x += length;
+        }
+    }
+
+    // Copies in over [x0, x1) of row y. Spans that are all background do not allocate tiles.
+    void writeRow(int y, int x0, int x1, const char* in) {
+        for (int x = x0; x < x1;) {
+            int length;
+            char* out = const_cast<char*>(span(x, y, length));
+            length = std::min(length, x1 - x);
+            if (!out && std::any_of(in, in + length, [this](char c) { return c != background; })) {
+                out = writableSpan(x, y, length);
+                length = std::min(length, x1 - x);
+            }
+            if (out) std::memcpy(out, in, length);
+            in += length;
+            x += length;
+        }
+    }
+
+    // Clearing keeps the tiles, so redrawing does not have to allocate them again; compact()
+    // and release() give them back.
+    void clear() {
+        if (!tiled) {
+            std::memset(cells.data(), background, cells.size());
+            std::fill(owners.begin(), owners.end(), NO_OWNER);
+            return;
+        }
+        for (std::unique_ptr<char[]>& tile : tiles) {
+            if (tile) std::memset(tile.get(), background, BOARD_TILE_SIZE * BOARD_TILE_SIZE);
+        }
+    }
+
+    // Clears the board and frees every tile.
+    void release() {
+        if (!tiled) {
+            clear();
+            return;
+        }
+        for (std::unique_ptr<char[]>& tile : tiles) tile.reset();
+    }
+
+    // Frees the tiles that hold nothing but background.
+    void compact() {
+        if (!tiled) return;
+        const size_t tile_bytes = BOARD_TILE_SIZE * BOARD_TILE_SIZE;
+        for (std::unique_ptr<char[]>& tile : tiles) {
+            // Every byte equals its neighbour and the first one is background.
+            if (tile && tile[0] == background && std::memcmp(tile.get(), tile.get() + 1, tile_bytes - 1) == 0) {
+                tile.reset();
             }
         }
     }
 
-    bool Fits(int x, int y) override {
-        return x - radius >= 0 && x + radius < BOARD_WIDTH && y - radius / FIGURE_SCALE >= 0 && y + radius / FIGURE_SCALE < BOARD_HEIGHT;
+    void clear(const Rect& region) {
+        Rect r = region.intersected(bounds());
+        if (r.empty()) return;
+        for (int y = r.y0; y < r.y1; ++y) {
+            fill(y, r.x0, r.x1, background);
+            if (!owners.empty()) std::fill_n(ownerRow(y) + r.x0, r.x1 - r.x0, NO_OWNER);
+        }
+    }
+};
+
+// What the rasterizers draw into: a board seen through a clip rect. Writes outside the clip are
+// dropped. It is a small value, so every render thread can hold its own with a different clip.
+// Shapes are drawn in scene coordinates; the board's cell (0, 0) is the scene's cell origin, which
+// lets a small board hold a window onto a big scene.
+struct Canvas {
+    Board* board;
+    Rect clip;
+    int origin_x = 0;
+    int origin_y = 0;
+    mutable int owner = NO_OWNER;  // id of the shape being drawn, for boards that keep owners
+#ifdef SHAPES_STATS
+    // Kept per canvas, so render threads never share them, and folded into render_stats once
+    // when the canvas goes away.
+    mutable uint64_t cells_written = 0;
+    mutable uint64_t shapes_drawn[SHAPE_KIND_COUNT] = {};
+    mutable uint64_t kind_cells[SHAPE_KIND_COUNT] = {};
+#endif
+
+    Canvas(Board& target) : board(&target), clip(target.bounds()) {}
+    Canvas(Board& target, const Rect& region) : board(&target), clip(region.intersected(target.bounds())) {}
+    Canvas(Board& target, const Rect& region, int x, int y)
+        : board(&target), clip(region.intersected({ x, y, x + target.width, y + target.height })), origin_x(x), origin_y(y) {}
+    Canvas(const Canvas&) = delete;
+    Canvas& operator=(const Canvas&) = delete;
+
+#ifdef SHAPES_STATS
+    ~Canvas() {
+        render_stats.cells_written.fetch_add(cells_written, std::memory_order_relaxed);
+        for (int kind = 0; kind < SHAPE_KIND_COUNT; ++kind) {
+            if (shapes_drawn[kind] == 0) continue;
+            render_stats.shapes_drawn[kind].fetch_add(shapes_drawn[kind], std::memory_order_relaxed);
+            render_stats.kind_cells[kind].fetch_add(kind_cells[kind], std::memory_order_relaxed);
+        }
+    }
+#endif
+
+    void set(int x, int y, char c) const {
+        if (x >= clip.x0 && x < clip.x1 && y >= clip.y0 && y < clip.y1) {
+            board->set(x - origin_x, y - origin_y, c);
+            if (!board->owners.empty()) board->ownerRow(y - origin_y)[x - origin_x] = owner;
+#ifdef SHAPES_STATS
+            ++cells_written;
+#endif
+        }
     }
 
-    bool Duplicate(const Information& info) override {
-        return info.type == "circle" && info.width == radius;
+    // Fills [x0, x1) of row y with c, clipped once against the clip rect.
+    void fillSpan(int y, int x0, int x1, char c) const {
+        if (y < clip.y0 || y >= clip.y1) return;
+        x0 = std::max(x0, clip.x0);
+        x1 = std::min(x1, clip.x1);
+        if (x0 >= x1) return;
+        board->fill(y - origin_y, x0 - origin_x, x1 - origin_x, c);
+        if (!board->owners.empty()) std::fill_n(board->ownerRow(y - origin_y) + x0 - origin_x, x1 - x0, owner);
+#ifdef SHAPES_STATS
+        cells_written += static_cast<uint64_t>(x1 - x0);
+#endif
     }
 };
 
-struct Square : public Shape {
-    int side_length;
+// Turns a board into terminal output. Each frame is composed into one reused buffer and written
+// with a single fwrite, or one fwrite per PRINT_CHUNK bytes for frames bigger than that. Plain
+// output is the glyph of every cell. In ANSI mode glyphs are drawn in their palette colour, and
+// only the rows that differ from the previous frame are sent, each behind a cursor-position
+// escape, which keeps redraws of big boards cheap over slow links. Rows are compared by hash, so
+// the printer holds eight bytes per row rather than a copy of the frame.
+struct BoardPrinter {
+    bool ansi = false;
+    std::vector<char> frame;
+    std::vector<char> cells_row;    // the row being compared, in ANSI mode
+    std::vector<uint64_t> shown;    // row hashes of the last ANSI frame
+    int shown_width = 0;
 
-    Square(int side) : side_length(side) {}
+    void setAnsi(bool on) {
+        ansi = on;
+        shown.clear();
+        shown_width = 0;
+    }
 
-    void draw(Board& board, int X, int Y, char outline, char fill, bool fillInside = false) override {
-        if (side_length <= 0) return;
+    void print(const Board& board) {
+        frame.clear();
+        std::cout.flush();
+        if (ansi) {
+            composeChangedRows(board);
+        }
+        else {
+            frame.reserve(std::min(static_cast<size_t>(board.width + 1) * board.height, PRINT_CHUNK + board.width + 1));
+            for (int y = 0; y < board.height; ++y) {
+                appendRow(board, y);
+                frame.push_back('\n');
+                flushIfFull();
+            }
+        }
+        std::fwrite(frame.data(), 1, frame.size(), stdout);
+        std::fflush(stdout);
+    }
 
-        for (int y = 0; y < side_length; ++y) {
-            float correctY = y / FIGURE_SCALE;
+private:
+    void appendRow(const Board& board, int y) {
+        size_t used = frame.size();
+        frame.resize(used + board.width);
+        board.readRow(y, 0, board.width, frame.data() + used);
+        ToGlyphs(frame.data() + used, board.width);
+    }
 
-            for (int x = 0; x < side_length; ++x) {
-                if (fillInside || y == 0 || y == side_length - 1 || x == 0 || x == side_length - 1) {
-                    int drawnX = X + x;
-                    int drawnY = Y + static_cast<int>(correctY);
-                    if (drawnX >= 0 && drawnX < BOARD_WIDTH && drawnY >= 0 && drawnY < BOARD_HEIGHT) {
-                        if (fillInside && y > 0 && y < side_length - 1 && x > 0 && x < side_length - 1) {
-                            board.grid[drawnY][drawnX] = fill;
-                        }
-                        else {
-                            board.grid[drawnY][drawnX] = outline;
-                        }
-                    }
-                }
+    // Glyphs in their colour, with an escape wherever the colour changes. Cells that are not a
+    // colour take the terminal's own, which is also what every row starts and ends with.
+    void appendColoredRow(const char* cells, int width) {
+        int current = 0;    // 0 is the terminal's colour, any other value a palette index
+        for (int x = 0; x < width; ++x) {
+            int color = static_cast<unsigned char>(cells[x]);
+            if (color < FIRST_NAMED_COLOR) color = 0;
+            const PaletteEntry& entry = ColorEntry(cells[x]);
+            if (color != current) {
+                char escape[32];
+                int length = color == 0 ? std::snprintf(escape, sizeof(escape), "\x1b[39m")
+                    : std::snprintf(escape, sizeof(escape), "\x1b[38;2;%d;%d;%dm", entry.r, entry.g, entry.b);
+                frame.insert(frame.end(), escape, escape + length);
+                current = color;
             }
+            frame.push_back(entry.glyph);
+        }
+        if (current != 0) {
+            const char reset[] = "\x1b[39m";
+            frame.insert(frame.end(), reset, reset + sizeof(reset) - 1);
+        }
+    }
+
+    void flushIfFull() {
+        if (frame.size() < PRINT_CHUNK) return;
+        std::fwrite(frame.data(), 1, frame.size(), stdout);
+        frame.clear();
+    }
+
+    static uint64_t HashRow(const char* cells_row, size_t width) {
+        uint64_t hash = 0x9E3779B97F4A7C15ull ^ width;
+        size_t i = 0;
+        for (; i + 8 <= width; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, cells_row + i, 8);
+            hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+            hash ^= hash >> 32;
+        }
+        for (; i < width; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(cells_row[i])) * 0x100000001B3ull;
         }
+        return hash;
     }
 
-    bool Fits(int x, int y) override {
-        return x >= 0 && x + side_length < BOARD_WIDTH && y >= 0 && y + side_length / FIGURE_SCALE < BOARD_HEIGHT;
+    void appendCursorTo(int row) {
+        char escape[32];
+        int length = std::snprintf(escape, sizeof(escape), "\x1b[%d;1H", row + 1);
+        frame.insert(frame.end(), escape, escape + length);
     }
 
-    bool Duplicate(const Information& info) override {
-        return info.type == "square" && info.width == side_length;
+    void composeChangedRows(const Board& board) {
+        size_t width = static_cast<size_t>(board.width);
+        bool full = shown_width != board.width || shown.size() != static_cast<size_t>(board.height);
+        if (full) {
+            shown.assign(board.height, 0);
+            shown_width = board.width;
+            const char clear_screen[] = "\x1b[H\x1b[2J";
+            frame.insert(frame.end(), clear_screen, clear_screen + sizeof(clear_screen) - 1);
+        }
+
+        cells_row.resize(width);
+        for (int y = 0; y < board.height; ++y) {
+            board.readRow(y, 0, board.width, cells_row.data());
+            uint64_t hash = HashRow(cells_row.data(), width);
+            if (!full && hash == shown[y]) continue;
+            shown[y] = hash;
+            appendCursorTo(y);
+            appendColoredRow(cells_row.data(), board.width);
+            flushIfFull();
+        }
+        // Park the cursor under the board so prompts do not overwrite it.
+        appendCursorTo(board.height);
     }
 };
 
-struct Triangle : public Shape {
-    int height;
+enum class ShapeKind : unsigned char {
+    Circle,
+    Square,
+    Triangle,
+    Line
+};
 
-    Triangle(int h) : height(h) {}
+// Charges a run of rasterized shapes of one kind, and the cells they wrote, to the canvas.
+// Only plain adds, so it is cheap enough to wrap every batch.
+struct RasterScope {
+    const Canvas& canvas;
+    int kind;
+    size_t count;
+    uint64_t cells_before = 0;
 
-    void draw(Board& board, int x, int y, char outline, char fill, bool fillInside = false) override {
-        if (height <= 0) return;
-        for (int i = 0; i < height; ++i) {
-            int left = x - i;
-            int right = x + i;
-            int posY = y + i;
+    RasterScope(const Canvas& target, ShapeKind shape_kind, size_t shapes)
+        : canvas(target), kind(static_cast<int>(shape_kind)), count(shapes) {
+#ifdef SHAPES_STATS
+        cells_before = canvas.cells_written;
+#endif
+    }
 
-            if (posY < BOARD_HEIGHT) {
-                if (fillInside) {
-                    for (int fillX = left; fillX <= right; ++fillX) {
-                        if (fillX >= 0 && fillX < BOARD_WIDTH)
-                            board.grid[posY][fillX] = fill;
-                    }
-                }
-                else {
-                    if (left >= 0 && left < BOARD_WIDTH)
-                        board.grid[posY][left] = outline;
-                    if (right >= 0 && right < BOARD_WIDTH && left != right)
-                        board.grid[posY][right] = outline;
-                }
+    ~RasterScope() {
+#ifdef SHAPES_STATS
+        canvas.shapes_drawn[kind] += count;
+        canvas.kind_cells[kind] += canvas.cells_written - cells_before;
+#endif
+    }
+};
+
+const char* KindName(ShapeKind kind) {
+    switch (kind) {
+    case ShapeKind::Circle: return "circle";
+    case ShapeKind::Square: return "square";
+    case ShapeKind::Triangle: return "triangle";
+    case ShapeKind::Line: return "line";
+    }
+    return "unknown";
+}
+
+bool KindFromName(const std::string& name, ShapeKind& kind) {
+    if (name == "circle") kind = ShapeKind::Circle;
+    else if (name == "square") kind = ShapeKind::Square;
+    else if (name == "triangle") kind = ShapeKind::Triangle;
+    else if (name == "line") kind = ShapeKind::Line;
+    else return false;
+    return true;
+}
+
+// A single shape as a plain value. The scene does not store these; it keeps one array per field.
+struct Information {
+    int id;
+    ShapeKind type;
+    int x, y;
+    int width, height;
+    char outline;
+    char fill;
+    bool filled;
+    int layer;
+
+    Information() : id(0), type(ShapeKind::Circle), x(0), y(0), width(0), height(0), outline(BACKGROUND_CELL), fill(BACKGROUND_CELL), filled(false), layer(0) {}
+    Information(int id, ShapeKind type, int x, int y, int dim1, int dim2 = 0, char outline = UNKNOWN_COLOR, char fill = BACKGROUND_CELL, bool filled = false)
+        : id(id), type(type), x(x), y(y), width(dim1), height(dim2), outline(outline), fill(fill), filled(filled), layer(0) {}
+};
+
+// Distance from the centre of a circle, computed exactly as the original per-cell loop did so the
+// span bounds land on the same cells.
+inline float CircleDistance(int x, int y) {
+    float correctY = y * FIGURE_SCALE;
+    float distance = sqrt(x * x + correctY * correctY);
+    return distance;
+}
+
+// Largest radius served from the compile-time row-extent table.
+#ifndef SHAPES_CIRCLE_TABLE_RADIUS
+#define SHAPES_CIRCLE_TABLE_RADIUS 64
+#endif
+
+// Up to this radius the float distance test agrees with pure integer arithmetic: 4 * (x^2 + (y * scale)^2)
+// is an integer that never equals (2 * radius +- 1)^2, and its square root stays further from
+// radius +- 1/2 than a float ulp.
+const int CIRCLE_EXACT_RADIUS = 1024;
+
+static_assert(SHAPES_CIRCLE_TABLE_RADIUS >= 1 && SHAPES_CIRCLE_TABLE_RADIUS <= CIRCLE_EXACT_RADIUS,
+    "the circle table is built with integer arithmetic, which is only exact up to CIRCLE_EXACT_RADIUS");
+
+// In 64 bits, so the count is right for any int radius, not only the ones ValidShapeGeometry lets in.
+constexpr int CircleRows(int radius, int scale) {
+    return static_cast<int>((2LL * radius + 1) / (2 * scale));
+}
+
+// Same contract as Circle::RowExtent, from integers only: the cell is on or outside the outline when
+// its distance is at least radius - 1/2, and past the outline when it is more than radius + 1/2.
+constexpr void CircleRowExtentExact(int radius, int y, int scale, int& inner, int& outer) {
+    long long dy = static_cast<long long>(y) * scale;
+    long long inner_limit = (2LL * radius - 1) * (2LL * radius - 1);
+    long long outer_limit = (2LL * radius + 1) * (2LL * radius + 1);
+
+    int lo = 0, hi = radius + 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (4 * (static_cast<long long>(mid) * mid + dy * dy) >= inner_limit) hi = mid;
+        else lo = mid + 1;
+    }
+    inner = lo;
+
+    hi = radius + 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (4 * (static_cast<long long>(mid) * mid + dy * dy) > outer_limit) hi = mid;
+        else lo = mid + 1;
+    }
+    outer = lo;
+}
+
+constexpr int CircleTableSize(int max_radius, int scale) {
+    int size = 0;
+    for (int radius = 1; radius <= max_radius; ++radius) {
+        size += CircleRows(radius, scale) + 1;
+    }
+    return size;
+}
+
+// Row extents for every radius up to MaxRadius and every |y| of that circle, computed by the
+// compiler. Rows of radius r start at start[r].
+template <int MaxRadius, int Scale>
+struct CircleExtentTable {
+    static constexpr int SIZE = CircleTableSize(MaxRadius, Scale);
+    int start[MaxRadius + 1];
+    unsigned short inner[SIZE];
+    unsigned short outer[SIZE];
+
+    constexpr CircleExtentTable() : start(), inner(), outer() {
+        int next = 0;
+        for (int radius = 1; radius <= MaxRadius; ++radius) {
+            start[radius] = next;
+            for (int y = 0; y <= CircleRows(radius, Scale); ++y) {
+                int row_inner = 0, row_outer = 0;
+                CircleRowExtentExact(radius, y, Scale, row_inner, row_outer);
+                inner[next] = static_cast<unsigned short>(row_inner);
+                outer[next] = static_cast<unsigned short>(row_outer);
+                ++next;
+            }
+        }
+    }
+};
+
+constexpr CircleExtentTable<SHAPES_CIRCLE_TABLE_RADIUS, FIGURE_SCALE> CIRCLE_EXTENTS{};
+
+struct Circle {
+    // A row of the circle is fill cells for |x| < inner, outline cells for inner <= |x| < outer,
+    // and nothing beyond. Distance grows with |x|, so both limits are found by binary search.
+    // This is the float reference, used only for radii past CIRCLE_EXACT_RADIUS.
+    static void RowExtent(int radius, int y, int& inner, int& outer) {
+        auto onOrOutsideOutline = [&](int x) {
+            float distance = CircleDistance(x, y);
+            return std::abs(distance - radius) <= 0.5 || !(distance < radius);
+        };
+        auto outsideOutline = [&](int x) {
+            float distance = CircleDistance(x, y);
+            return !(std::abs(distance - radius) <= 0.5) && !(distance < radius);
+        };
+
+        int lo = 0, hi = radius + 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (onOrOutsideOutline(mid)) hi = mid;
+            else lo = mid + 1;
+        }
+        inner = lo;
+
+        hi = radius + 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (outsideOutline(mid)) hi = mid;
+            else lo = mid + 1;
+        }
+        outer = lo;
+    }
+
+    // Each row is two outline spans and, when filled, the span between them. An empty inner part
+    // makes the two outline spans meet at the centre and the fill span empty, so rows need no
+    // special cases. extent(|y|, inner, outer) supplies the row limits.
+    template <bool Filled, typename Extent>
+    static void drawRows(const Canvas& canvas, int X, int Y, int radius, char outline, char fill, Extent extent) {
+        int rows = CircleRows(radius, FIGURE_SCALE);
+        int y0 = std::max(-rows, canvas.clip.y0 - Y);
+        int y1 = std::min(rows, canvas.clip.y1 - 1 - Y);
+        for (int y = y0; y <= y1; ++y) {
+            int inner, outer;
+            extent(y < 0 ? -y : y, inner, outer);
+
+            int drawnY = Y + y;
+            canvas.fillSpan(drawnY, X - outer + 1, X - inner + 1, outline);
+            canvas.fillSpan(drawnY, X + inner, X + outer, outline);
+            if (Filled) {
+                canvas.fillSpan(drawnY, X - inner + 1, X + inner, fill);
+            }
+        }
+    }
+
+    // The row limits drawKernel uses, for a single row.
+    static void Extent(int radius, int y, int& inner, int& outer) {
+        if (radius <= SHAPES_CIRCLE_TABLE_RADIUS) {
+            inner = CIRCLE_EXTENTS.inner[CIRCLE_EXTENTS.start[radius] + y];
+            outer = CIRCLE_EXTENTS.outer[CIRCLE_EXTENTS.start[radius] + y];
+        }
+        else if (radius <= CIRCLE_EXACT_RADIUS) {
+            CircleRowExtentExact(radius, y, FIGURE_SCALE, inner, outer);
+        }
+        else {
+            RowExtent(radius, y, inner, outer);
+        }
+    }
+
+    template <bool Filled>
+    static void drawKernel(const Canvas& canvas, int X, int Y, int radius, char outline, char fill) {
+        if (radius <= SHAPES_CIRCLE_TABLE_RADIUS) {
+            const int base = CIRCLE_EXTENTS.start[radius];
+            drawRows<Filled>(canvas, X, Y, radius, outline, fill, [base](int y, int& inner, int& outer) {
+                inner = CIRCLE_EXTENTS.inner[base + y];
+                outer = CIRCLE_EXTENTS.outer[base + y];
+                });
+        }
+        else if (radius <= CIRCLE_EXACT_RADIUS) {
+            drawRows<Filled>(canvas, X, Y, radius, outline, fill, [radius](int y, int& inner, int& outer) {
+                CircleRowExtentExact(radius, y, FIGURE_SCALE, inner, outer);
+                });
+        }
+        else {
+            drawRows<Filled>(canvas, X, Y, radius, outline, fill, [radius](int y, int& inner, int& outer) {
+                RowExtent(radius, y, inner, outer);
+                });
+        }
+    }
+
+    static void draw(const Canvas& canvas, int X, int Y, int radius, char outline, char fill, bool fillInside) {
+        if (radius <= 0) return;
+        if (fillInside) drawKernel<true>(canvas, X, Y, radius, outline, fill);
+        else drawKernel<false>(canvas, X, Y, radius, outline, fill);
+    }
+
+    // Whether draw() writes cell (x, y): the spans of drawRows, tested instead of filled.
+    static bool Covers(int X, int Y, int radius, bool fillInside, int x, int y) {
+        if (radius <= 0) return false;
+        int row = y < Y ? Y - y : y - Y;
+        if (row > CircleRows(radius, FIGURE_SCALE)) return false;
+        int inner, outer;
+        Extent(radius, row, inner, outer);
+        int dx = x - X;
+        if (dx >= 1 - outer && dx < 1 - inner) return true;
+        if (dx >= inner && dx < outer) return true;
+        return fillInside && dx >= 1 - inner && dx < inner;
+    }
+
+    static bool Fits(const Board& board, int x, int y, int radius) {
+        return x - radius >= 0 && x + radius < board.width && y - radius / FIGURE_SCALE >= 0 && y + radius / FIGURE_SCALE < board.height;
+    }
+
+    // Every cell draw() can touch when anchored at (x, y).
+    static Rect Bounds(int x, int y, int radius) {
+        if (radius <= 0) return { x, y, x, y };
+        int rows = CircleRows(radius, FIGURE_SCALE);
+        return { x - radius, y - rows, x + radius + 1, y + rows + 1 };
+    }
+};
+
+struct Square {
+    // Logical rows are squashed by Scale, so board row r receives logical rows r * Scale up to
+    // last. Writing them in order leaves a full outline row when last is the bottom edge, or, for
+    // an unfilled square, when the top edge is among them (the edges-only rows after it do not
+    // clear its interior). Any other row ends up as two edge cells around the fill.
+    template <int Scale, bool Filled>
+    static void drawKernel(const Canvas& canvas, int X, int Y, int side_length, char outline, char fill) {
+        int rows = (side_length - 1) / Scale + 1;
+        int r0 = std::max(0, canvas.clip.y0 - Y);
+        int r1 = std::min(rows, canvas.clip.y1 - Y);
+        for (int r = r0; r < r1; ++r) {
+            int first = r * Scale;
+            int last = std::min(first + Scale - 1, side_length - 1);
+            bool full = last == side_length - 1 || (!Filled && first == 0);
+
+            int drawnY = Y + r;
+            canvas.set(X, drawnY, outline);
+            canvas.set(X + side_length - 1, drawnY, outline);
+            if (Filled || full) {
+                canvas.fillSpan(drawnY, X + 1, X + side_length - 1, full ? outline : fill);
+            }
+        }
+    }
+
+    static void draw(const Canvas& canvas, int X, int Y, int side_length, char outline, char fill, bool fillInside) {
+        if (side_length <= 0) return;
+        if (fillInside) drawKernel<FIGURE_SCALE, true>(canvas, X, Y, side_length, outline, fill);
+        else drawKernel<FIGURE_SCALE, false>(canvas, X, Y, side_length, outline, fill);
+    }
+
+    static bool Covers(int X, int Y, int side_length, bool fillInside, int x, int y) {
+        if (side_length <= 0) return false;
+        int r = y - Y;
+        if (r < 0 || r >= (side_length - 1) / FIGURE_SCALE + 1 || x < X || x >= X + side_length) return false;
+        if (x == X || x == X + side_length - 1) return true;
+        int first = r * FIGURE_SCALE;
+        int last = std::min(first + FIGURE_SCALE - 1, side_length - 1);
+        return fillInside || last == side_length - 1 || first == 0;
+    }
+
+    static bool Fits(const Board& board, int x, int y, int side_length) {
+        return x >= 0 && x + side_length < board.width && y >= 0 && y + side_length / FIGURE_SCALE < board.height;
+    }
+
+    static Rect Bounds(int x, int y, int side_length) {
+        if (side_length <= 0) return { x, y, x, y };
+        return { x, y, x + side_length, y + (side_length - 1) / FIGURE_SCALE + 1 };
+    }
+};
+
+struct Triangle {
+    template <bool Filled>
+    static void drawKernel(const Canvas& canvas, int x, int y, int height, char outline, char fill) {
+        int i0 = std::max(0, canvas.clip.y0 - y);
+        int i1 = std::min(height, canvas.clip.y1 - y);
+        for (int i = i0; i < i1; ++i) {
+            int posY = y + i;
+            if (Filled) {
+                canvas.fillSpan(posY, x - i, x + i + 1, fill);
+            }
+            else {
+                canvas.set(x - i, posY, outline);
+                canvas.set(x + i, posY, outline);
+            }
+        }
+
+        canvas.fillSpan(y + height - 1, x - height + 1, x + height, outline);
+    }
+
+    static void draw(const Canvas& canvas, int x, int y, int height, char outline, char fill, bool fillInside) {
+        if (height <= 0) return;
+        if (fillInside) drawKernel<true>(canvas, x, y, height, outline, fill);
+        else drawKernel<false>(canvas, x, y, height, outline, fill);
+    }
+
+    // The bottom row is always a full outline; above it, a filled triangle covers everything
+    // between its edges and a hollow one only the edges.
+    static bool Covers(int X, int Y, int height, bool fillInside, int x, int y) {
+        int i = y - Y;
+        if (height <= 0 || i < 0 || i >= height) return false;
+        int dx = x < X ? X - x : x - X;
+        if (i == height - 1) return dx <= i;
+        return fillInside ? dx <= i : dx == i;
+    }
+
+    static bool Fits(const Board& board, int x, int y, int height) {
+        return x - height >= 0 && x + height < board.width && y >= 0 && y + height < board.height;
+    }
+
+    static Rect Bounds(int x, int y, int height) {
+        if (height <= 0) return { x, y, x, y };
+        return { x - height + 1, y, x + height, y + height };
+    }
+};
+
+struct Line {
+    static void draw(const Canvas& canvas, int X, int Y, int length, char outline, char, bool) {
+        if (length <= 0) return;
+        canvas.fillSpan(Y, X, X + length, outline);
+    }
+
+    static bool Covers(int X, int Y, int length, bool, int x, int y) {
+        return y == Y && x >= X && x < X + length;
+    }
+
+    static bool Fits(const Board& board, int x, int y, int length) {
+        return x >= 0 && x + length < board.width && y >= 0 && y < board.height;
+    }
+
+    static Rect Bounds(int x, int y, int length) {
+        if (length <= 0) return { x, y, x, y };
+        return { x, y, x + length, y + 1 };
+    }
+};
+
+// Coordinates and sizes, including those read from files and logs, stay within MAX_BOARD_SIDE of
+// zero, which keeps the Fits and Bounds sums and the circle row counts inside an int. No shape
+// further out than that could be on a board anyway.
+bool InShapeRange(int value) {
+    return value >= -MAX_BOARD_SIDE && value <= MAX_BOARD_SIDE;
+}
+
+bool ValidShapeGeometry(const Information& info) {
+    return InShapeRange(info.x) && InShapeRange(info.y) && InShapeRange(info.width) && InShapeRange(info.height);
+}
+
+bool ShapeFits(const Board& board, ShapeKind kind, int x, int y, int dim) {
+    if (!InShapeRange(x) || !InShapeRange(y) || !InShapeRange(dim)) return false;
+    switch (kind) {
+    case ShapeKind::Circle: return Circle::Fits(board, x, y, dim);
+    case ShapeKind::Square: return Square::Fits(board, x, y, dim);
+    case ShapeKind::Triangle: return Triangle::Fits(board, x, y, dim);
+    case ShapeKind::Line: return Line::Fits(board, x, y, dim);
+    }
+    return false;
+}
+
+Rect ShapeBounds(ShapeKind kind, int x, int y, int dim) {
+    switch (kind) {
+    case ShapeKind::Circle: return Circle::Bounds(x, y, dim);
+    case ShapeKind::Square: return Square::Bounds(x, y, dim);
+    case ShapeKind::Triangle: return Triangle::Bounds(x, y, dim);
+    case ShapeKind::Line: return Line::Bounds(x, y, dim);
+    }
+    return { x, y, x, y };
+}
+
+// Whether the shape paints cell (x, y) when drawn; hit-testing uses the rasterizers' geometry,
+// not bounds, so the inside of a hollow shape is not covered.
+bool ShapeCovers(ShapeKind kind, int X, int Y, int dim, bool filled, int x, int y) {
+    switch (kind) {
+    case ShapeKind::Circle: return Circle::Covers(X, Y, dim, filled, x, y);
+    case ShapeKind::Square: return Square::Covers(X, Y, dim, filled, x, y);
+    case ShapeKind::Triangle: return Triangle::Covers(X, Y, dim, filled, x, y);
+    case ShapeKind::Line: return Line::Covers(X, Y, dim, filled, x, y);
+    }
+    return false;
+}
+
+void DrawShape(const Canvas& canvas, const Information& info) {
+    SHAPES_STAT_SCOPE(RasterScope, canvas, info.type, 1);
+    canvas.owner = info.id;
+    switch (info.type) {
+    case ShapeKind::Circle: Circle::draw(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+    case ShapeKind::Square: Square::draw(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+    case ShapeKind::Triangle: Triangle::draw(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+    case ShapeKind::Line: Line::draw(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+    }
+}
+
+// A growable array whose copies share storage until one of them writes. Items live in chunks of
+// 1 << SHIFT, each with a reference count, behind a table of chunk pointers that is counted too.
+// Copying the array takes one increment; the first write to a shared table copies its pointers,
+// and the first write to a shared chunk copies that chunk only. Counts are atomic so copies can
+// be read and dropped on any thread, but each copy still has one writer. Items stay where they
+// are when the array grows, so a reference is good until the array is cleared or assigned.
+template <typename T, int SHIFT = 10>
+struct CowArray {
+    static constexpr size_t CHUNK = size_t(1) << SHIFT;
+
+    struct Chunk {
+        std::atomic<int> refs{ 1 };
+        T items[CHUNK];
+    };
+
+    struct Table {
+        std::atomic<int> refs{ 1 };
+        std::vector<Chunk*> chunks;
+
+        ~Table() {
+            for (Chunk* chunk : chunks) Release(chunk);
+        }
+    };
+
+    CowArray() = default;
+
+    CowArray(const CowArray& other) : table(other.table), chunks(other.chunks), count(other.count) {
+        if (table) table->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    CowArray(CowArray&& other) noexcept : table(other.table), chunks(other.chunks), count(other.count) {
+        other.table = nullptr;
+        other.chunks = nullptr;
+        other.count = 0;
+    }
+
+    CowArray& operator=(CowArray other) noexcept {
+        std::swap(table, other.table);
+        std::swap(chunks, other.chunks);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    ~CowArray() { Release(table); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const T& operator[](size_t i) const { return chunks[i >> SHIFT]->items[i & (CHUNK - 1)]; }
+    T& operator[](size_t i) { return writableChunk(i >> SHIFT).items[i & (CHUNK - 1)]; }
+
+    const T& back() const { return (*this)[count - 1]; }
+    T& back() { return (*this)[count - 1]; }
+
+    void push_back(const T& value) {
+        Table& own = writableTable();
+        if ((count >> SHIFT) == own.chunks.size()) {
+            own.chunks.push_back(new Chunk);
+            chunks = own.chunks.data();
+        }
+        (*this)[count] = value;
+        ++count;
+    }
+
+    void pop_back() { --count; }
+
+    // Keeps the chunks when nothing else shares them, so refilling does not allocate.
+    void clear() {
+        if (table && table->refs.load(std::memory_order_acquire) != 1) {
+            Release(table);
+            table = nullptr;
+            chunks = nullptr;
+        }
+        count = 0;
+    }
+
+    void reserve(size_t n) {
+        Table& own = writableTable();
+        own.chunks.reserve((n + CHUNK - 1) >> SHIFT);
+        chunks = own.chunks.data();
+    }
+
+    void resize(size_t n, const T& value) {
+        while (count < n) push_back(value);
+        count = n;
+    }
+
+private:
+    Table* table = nullptr;
+    Chunk** chunks = nullptr;   // table->chunks.data(), one load fewer on every read
+    size_t count = 0;
+
+    static void Release(Table* table) {
+        if (table && table->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete table;
+    }
+
+    static void Release(Chunk* chunk) {
+        if (chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete chunk;
+    }
+
+    Table& writableTable() {
+        if (!table) {
+            table = new Table;
+        }
+        else if (table->refs.load(std::memory_order_acquire) != 1) {
+            Table* own = new Table;
+            own->chunks = table->chunks;
+            for (Chunk* chunk : own->chunks) chunk->refs.fetch_add(1, std::memory_order_relaxed);
+            Release(table);
+            table = own;
+        }
+        chunks = table->chunks.data();
+        return *table;
+    }
+
+    Chunk& writableChunk(size_t c) {
+        writableTable();
+        Chunk*& chunk = chunks[c];
+        if (chunk->refs.load(std::memory_order_acquire) != 1) {
+            Chunk* own = new Chunk;
+            size_t live = std::min(CHUNK, count - (c << SHIFT));
+            std::copy(chunk->items, chunk->items + live, own->items);
+            Release(chunk);
+            chunk = own;
+        }
+        return *chunk;
+    }
+};
+
+// Uniform grid over the board. Every bucket lists the shapes whose footprint touches it,
+// so collision and placement checks only look at shapes near the area in question. Buckets are
+// shared copy-on-write in chunks of 256, so copying an index takes constant time and a write to
+// the copy duplicates only the chunks of the buckets it touches.
+struct SpatialIndex {
+    struct Entry {
+        int id;
+        int x, y;
+        Rect bounds;
+    };
+
+    int cols = 0;
+    int rows = 0;
+    // INDEX_CELL_SIZE, doubled on huge boards until the grid has at most MAX_INDEX_BUCKETS buckets.
+    int cell_size = INDEX_CELL_SIZE;
+    CowArray<std::vector<Entry>, 8> buckets;
+    // A bucket whose stamp is not the current epoch is empty. Clearing just bumps the epoch, and
+    // stale buckets are emptied, keeping their capacity, the next time something is inserted.
+    CowArray<uint32_t> stamps;
+    uint32_t epoch = 1;
+
+    void clear() {
+        if (++epoch == 0) {
+            for (size_t cell = 0; cell < stamps.size(); ++cell) stamps[cell] = 0;
+            epoch = 1;
+        }
+    }
+
+    void reset(int width, int height) {
+        int new_size = INDEX_CELL_SIZE;
+        auto columns = [&] { return std::max(1, (width + new_size - 1) / new_size); };
+        auto rows_for = [&] { return std::max(1, (height + new_size - 1) / new_size); };
+        while (static_cast<size_t>(columns()) * rows_for() > MAX_INDEX_BUCKETS) new_size *= 2;
+        int new_cols = columns();
+        int new_rows = rows_for();
+        if (new_cols == cols && new_rows == rows && new_size == cell_size) {
+            clear();
+            return;
+        }
+        cell_size = new_size;
+        cols = new_cols;
+        rows = new_rows;
+        buckets.clear();
+        buckets.resize(static_cast<size_t>(cols) * rows, {});
+        stamps.clear();
+        stamps.resize(buckets.size(), epoch);
+    }
+
+    std::vector<Entry>& writable(size_t cell) {
+        if (stamps[cell] != epoch) {
+            buckets[cell].clear();
+            stamps[cell] = epoch;
+        }
+        return buckets[cell];
+    }
+
+    // Range of buckets covered by area, clamped to the grid.
+    Rect cellsOf(const Rect& area) const {
+        int cx0 = std::clamp(area.x0 / cell_size, 0, cols - 1);
+        int cy0 = std::clamp(area.y0 / cell_size, 0, rows - 1);
+        int cx1 = std::clamp((area.x1 - 1) / cell_size, 0, cols - 1);
+        int cy1 = std::clamp((area.y1 - 1) / cell_size, 0, rows - 1);
+        return { cx0, cy0, cx1 + 1, cy1 + 1 };
+    }
+
+    void insert(const Entry& entry) {
+        Rect cells = cellsOf(entry.bounds);
+        for (int cy = cells.y0; cy < cells.y1; ++cy) {
+            for (int cx = cells.x0; cx < cells.x1; ++cx) {
+                writable(static_cast<size_t>(cy) * cols + cx).push_back(entry);
+            }
+        }
+    }
+
+    void erase(int id, const Rect& bounds) {
+        Rect cells = cellsOf(bounds);
+        for (int cy = cells.y0; cy < cells.y1; ++cy) {
+            for (int cx = cells.x0; cx < cells.x1; ++cx) {
+                auto& bucket = writable(static_cast<size_t>(cy) * cols + cx);
+                for (size_t i = 0; i < bucket.size(); ++i) {
+                    if (bucket[i].id == id) {
+                        bucket[i] = bucket.back();
+                        bucket.pop_back();
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Calls visit once per shape whose bounds intersect area; stops early when visit returns true.
+    template <typename Visitor>
+    bool any(const Rect& area, Visitor visit) const {
+        Rect cells = cellsOf(area);
+        for (int cy = cells.y0; cy < cells.y1; ++cy) {
+            for (int cx = cells.x0; cx < cells.x1; ++cx) {
+                size_t cell = static_cast<size_t>(cy) * cols + cx;
+                if (stamps[cell] != epoch) continue;
+                for (const Entry& entry : buckets[cell]) {
+                    if (!entry.bounds.intersects(area)) continue;
+                    // A shape spanning several buckets is reported only from the first one it shares with area.
+                    Rect shared = cellsOf(entry.bounds.intersected(area));
+                    if (shared.x0 != cx || shared.y0 != cy) continue;
+                    if (visit(entry)) return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+// A named group of shapes that is composited as one. Layers are never deleted, so a layer id
+// stays valid for as long as the scene exists.
+struct SceneLayer {
+    std::string name;
+    bool visible = true;
+    int position = 0;   // index in Scene::layer_order
+};
+
+// Shapes live in dense per-field arrays indexed by slot; slot_of maps a shape id to its slot.
+// Removal swaps the last slot into the hole, so ids stay stable while slots do not.
+// Drawing order is kept separately as a doubly linked list over ids, tail on top, and z_key
+// gives every id a number that grows along that list so a handful of ids can be sorted by depth.
+// On screen, layers are stacked in layer_order and depth only orders shapes within a layer.
+struct Scene {
+    CowArray<int> ids;
+    CowArray<ShapeKind> kinds;
+    CowArray<int> xs, ys;
+    CowArray<int> widths, heights;
+    CowArray<char> outlines, fills;
+    CowArray<unsigned char> filled;
+    CowArray<int> layers;
+
+    std::vector<SceneLayer> layer_table;    // indexed by layer id
+    std::vector<int> layer_order;           // layer ids, bottom to top
+
+    CowArray<int> slot_of;
+    CowArray<int> z_prev;
+    CowArray<int> z_next;
+    CowArray<long long> z_key;
+    int z_head = -1;
+    int z_tail = -1;
+    long long next_z_key = 0;
+    SpatialIndex index;
+    // When set, placement and moves also reject footprints that intersect another shape.
+    bool reject_overlap = false;
+
+    Scene(const Board& board) {
+        index.reset(board.width, board.height);
+        addLayer("base");
+    }
+
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+
+    // Copies are explicit so they only happen where they are meant to. The shape arrays and the
+    // index's buckets are shared with other until either scene writes to them, so copying takes
+    // constant time whatever the scene's size, and the writer then pays for the chunks it
+    // touches, once each.
+    void assign(const Scene& other) {
+        assignShapes(other);
+        index = other.index;
+    }
+
+    // The same without the spatial index, which is left empty: enough to save or list the copy,
+    // but not to query or render it.
+    void assignShapes(const Scene& other) {
+        ids = other.ids;
+        kinds = other.kinds;
+        xs = other.xs;
+        ys = other.ys;
+        widths = other.widths;
+        heights = other.heights;
+        outlines = other.outlines;
+        fills = other.fills;
+        filled = other.filled;
+        layers = other.layers;
+        layer_table = other.layer_table;
+        layer_order = other.layer_order;
+        slot_of = other.slot_of;
+        z_prev = other.z_prev;
+        z_next = other.z_next;
+        z_key = other.z_key;
+        z_head = other.z_head;
+        z_tail = other.z_tail;
+        next_z_key = other.next_z_key;
+        reject_overlap = other.reject_overlap;
+        index.clear();
+    }
+
+    size_t size() const { return ids.size(); }
+
+    // Slot of the shape with this id, or -1.
+    int find(int id) const {
+        if (id < 0 || id >= static_cast<int>(slot_of.size())) return -1;
+        return slot_of[id];
+    }
+
+    // Slot of the shape drawn last, or -1 when the scene is empty.
+    int topmost() const {
+        return z_tail < 0 ? -1 : slot_of[z_tail];
+    }
+
+    // Calls visit(slot) for every shape from bottom to top.
+    template <typename Visitor>
+    void forEachInOrder(Visitor visit) const {
+        for (int id = z_head; id >= 0; id = z_next[id]) {
+            visit(static_cast<size_t>(slot_of[id]));
+        }
+    }
+
+    Information get(size_t i) const {
+        Information info(ids[i], kinds[i], xs[i], ys[i], widths[i], heights[i], outlines[i], fills[i], filled[i] != 0);
+        info.layer = layers[i];
+        return info;
+    }
+
+    bool layered() const { return layer_table.size() > 1; }
+
+    // Id of the layer with this name, or -1.
+    int findLayer(const std::string& name) const {
+        for (size_t layer = 0; layer < layer_table.size(); ++layer) {
+            if (layer_table[layer].name == name) return static_cast<int>(layer);
+        }
+        return -1;
+    }
+
+    // Creates an empty, visible layer on top of the stack and returns its id.
+    int addLayer(const std::string& name) {
+        int layer = static_cast<int>(layer_table.size());
+        SceneLayer entry;
+        entry.name = name;
+        entry.position = static_cast<int>(layer_order.size());
+        layer_table.push_back(entry);
+        layer_order.push_back(layer);
+        return layer;
+    }
+
+    // Moves the layer to the given index of the stack, 0 being the bottom.
+    void moveLayer(int layer, int position) {
+        layer_order.erase(layer_order.begin() + layer_table[layer].position);
+        layer_order.insert(layer_order.begin() + position, layer);
+        for (size_t i = 0; i < layer_order.size(); ++i) {
+            layer_table[layer_order[i]].position = static_cast<int>(i);
+        }
+    }
+
+    // Whether shape i is drawn when rendering layer: layer -1 stands for the composited scene,
+    // which has the shapes of every visible layer; a single layer is rendered whether shown or not.
+    bool drawnIn(size_t i, int layer) const {
+        return layer < 0 ? layer_table[layers[i]].visible : layers[i] == layer;
+    }
+
+    Rect footprint(size_t i) const {
+        return ShapeBounds(kinds[i], xs[i], ys[i], widths[i]);
+    }
+
+    // What the index stores: the footprint, or just the anchor cell for degenerate shapes.
+    Rect indexBounds(size_t i) const {
+        Rect bounds = footprint(i);
+        if (bounds.empty()) {
+            return { xs[i], ys[i], xs[i] + 1, ys[i] + 1 };
+        }
+        return bounds;
+    }
+
+    void add(const Information& info) {
+        insert(info, z_tail, next_z_key++);
+    }
+
+    // Links the shape into the depth order just above the shape with id below (-1 for the
+    // bottom) under the given depth key. Undo uses this to put shapes back where they were.
+    void insert(const Information& info, int below, long long key) {
+        int id = info.id;
+        if (id >= static_cast<int>(slot_of.size())) {
+            slot_of.resize(id + 1, -1);
+            z_prev.resize(id + 1, -1);
+            z_next.resize(id + 1, -1);
+            z_key.resize(id + 1, 0);
+        }
+
+        slot_of[id] = static_cast<int>(ids.size());
+        ids.push_back(id);
+        kinds.push_back(info.type);
+        xs.push_back(info.x);
+        ys.push_back(info.y);
+        widths.push_back(info.width);
+        heights.push_back(info.height);
+        outlines.push_back(info.outline);
+        fills.push_back(info.fill);
+        filled.push_back(info.filled ? 1 : 0);
+        layers.push_back(info.layer);
+
+        int above = below >= 0 ? z_next[below] : z_head;
+        z_prev[id] = below;
+        z_next[id] = above;
+        if (below >= 0) z_next[below] = id;
+        else z_head = id;
+        if (above >= 0) z_prev[above] = id;
+        else z_tail = id;
+        z_key[id] = key;
+        next_z_key = std::max(next_z_key, key + 1);
+
+        index.insert({ id, info.x, info.y, indexBounds(ids.size() - 1) });
+    }
+
+    // Overwrites every field of shape i except its id and keeps the index in step.
+    void update(size_t i, const Information& info) {
+        Rect old_bounds = indexBounds(i);
+        bool moved = kinds[i] != info.type || xs[i] != info.x || ys[i] != info.y || widths[i] != info.width;
+
+        kinds[i] = info.type;
+        xs[i] = info.x;
+        ys[i] = info.y;
+        widths[i] = info.width;
+        heights[i] = info.height;
+        outlines[i] = info.outline;
+        fills[i] = info.fill;
+        filled[i] = info.filled ? 1 : 0;
+        layers[i] = info.layer;
+
+        if (moved) {
+            index.erase(ids[i], old_bounds);
+            index.insert({ ids[i], xs[i], ys[i], indexBounds(i) });
+        }
+    }
+
+    void remove(size_t i) {
+        int id = ids[i];
+        index.erase(id, indexBounds(i));
+
+        if (z_prev[id] >= 0) z_next[z_prev[id]] = z_next[id];
+        else z_head = z_next[id];
+        if (z_next[id] >= 0) z_prev[z_next[id]] = z_prev[id];
+        else z_tail = z_prev[id];
+
+        size_t last = ids.size() - 1;
+        if (i != last) {
+            ids[i] = ids[last];
+            kinds[i] = kinds[last];
+            xs[i] = xs[last];
+            ys[i] = ys[last];
+            widths[i] = widths[last];
+            heights[i] = heights[last];
+            outlines[i] = outlines[last];
+            fills[i] = fills[last];
+            filled[i] = filled[last];
+            layers[i] = layers[last];
+            slot_of[ids[i]] = static_cast<int>(i);
+        }
+        ids.pop_back();
+        kinds.pop_back();
+        xs.pop_back();
+        ys.pop_back();
+        widths.pop_back();
+        heights.pop_back();
+        outlines.pop_back();
+        fills.pop_back();
+        filled.pop_back();
+        layers.pop_back();
+        slot_of[id] = -1;
+    }
+
+    // Drops every shape. The layers stay, empty.
+    void clear() {
+        ids.clear();
+        kinds.clear();
+        xs.clear();
+        ys.clear();
+        widths.clear();
+        heights.clear();
+        outlines.clear();
+        fills.clear();
+        filled.clear();
+        layers.clear();
+        slot_of.clear();
+        z_prev.clear();
+        z_next.clear();
+        z_key.clear();
+        z_head = z_tail = -1;
+        next_z_key = 0;
+        index.clear();
+    }
+
+    // Room for ids up to and including last_id in the id-indexed arrays.
+    void reserveIds(int last_id) {
+        size_t count = static_cast<size_t>(last_id) + 1;
+        slot_of.reserve(count);
+        z_prev.reserve(count);
+        z_next.reserve(count);
+        z_key.reserve(count);
+    }
+
+    void reserve(size_t count) {
+        ids.reserve(count);
+        kinds.reserve(count);
+        xs.reserve(count);
+        ys.reserve(count);
+        widths.reserve(count);
+        heights.reserve(count);
+        outlines.reserve(count);
+        fills.reserve(count);
+        filled.reserve(count);
+        layers.reserve(count);
+    }
+
+    void rebuildIndex(const Board& board) {
+        index.reset(board.width, board.height);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            index.insert({ ids[i], xs[i], ys[i], indexBounds(i) });
+        }
+    }
+
+    // Fills found with the ids of the shapes whose footprint intersects area, bottom to top.
+    // The caller owns the buffer so redraws can reuse one instead of allocating each time.
+    void shapesIn(const Rect& area, std::vector<int>& found) const {
+        found.clear();
+        index.any(area, [&](const SpatialIndex::Entry& entry) {
+            found.push_back(entry.id);
+            return false;
+            });
+        std::sort(found.begin(), found.end(), [this](int a, int b) { return z_key[a] < z_key[b]; });
+    }
+
+    // Fills slots with what rendering layer (see drawnIn) paints inside area, in painting order.
+    void drawOrder(const Rect& area, int layer, std::vector<int>& slots) const {
+        shapesIn(area, slots);
+        size_t kept = 0;
+        for (int id : slots) {
+            int slot = slot_of[id];
+            if (drawnIn(slot, layer)) slots[kept++] = slot;
+        }
+        slots.resize(kept);
+        sortByLayer(layer, slots);
+    }
+
+    // The same for the whole board.
+    void drawOrder(int layer, std::vector<int>& slots) const {
+        slots.clear();
+        forEachInOrder([&](size_t slot) {
+            if (drawnIn(slot, layer)) slots.push_back(static_cast<int>(slot));
+            });
+        sortByLayer(layer, slots);
+    }
+
+    bool covers(size_t slot, int x, int y) const {
+        return ShapeCovers(kinds[slot], xs[slot], ys[slot], widths[slot], filled[slot] != 0, x, y);
+    }
+
+    // Fills slots with the shapes the composited scene paints at cell (x, y), topmost first,
+    // or with just the topmost one unless all is set.
+    void shapesAt(int x, int y, bool all, std::vector<int>& slots) const {
+        drawOrder({ x, y, x + 1, y + 1 }, -1, slots);
+        if (!all) {
+            for (size_t n = slots.size(); n-- > 0;) {
+                if (!covers(slots[n], x, y)) continue;
+                slots[0] = slots[n];
+                slots.resize(1);
+                return;
+            }
+            slots.clear();
+            return;
+        }
+        size_t kept = 0;
+        for (int slot : slots) {
+            if (covers(slot, x, y)) slots[kept++] = slot;
+        }
+        slots.resize(kept);
+        std::reverse(slots.begin(), slots.end());
+    }
+
+    // Slots arrive in depth order; the composited scene paints them layer by layer.
+    void sortByLayer(int layer, std::vector<int>& slots) const {
+        if (layer >= 0 || !layered()) return;
+        std::sort(slots.begin(), slots.end(), [this](int a, int b) {
+            int position_a = layer_table[layers[a]].position;
+            int position_b = layer_table[layers[b]].position;
+            if (position_a != position_b) return position_a < position_b;
+            return z_key[ids[a]] < z_key[ids[b]];
+            });
+    }
+
+    bool anchorTaken(int x, int y, int ignore_id) const {
+        return index.any({ x, y, x + 1, y + 1 }, [&](const SpatialIndex::Entry& entry) {
+            return entry.id != ignore_id && entry.x == x && entry.y == y;
+            });
+    }
+
+    bool overlaps(const Rect& area, int ignore_id) const {
+        return index.any(area, [&](const SpatialIndex::Entry& entry) {
+            return entry.id != ignore_id;
+            });
+    }
+};
+
+// Draws slots[0..count) in order. They all share one kind, so the switch happens once per run
+// and the loop reads the scene's field arrays directly.
+void DrawBatch(const Canvas& canvas, const Scene& scene, ShapeKind kind, const int* slots, size_t count) {
+    SHAPES_STAT_SCOPE(RasterScope, canvas, kind, count);
+    switch (kind) {
+    case ShapeKind::Circle:
+        for (size_t n = 0; n < count; ++n) {
+            int i = slots[n];
+            canvas.owner = scene.ids[i];
+            Circle::draw(canvas, scene.xs[i], scene.ys[i], scene.widths[i], scene.outlines[i], scene.fills[i], scene.filled[i] != 0);
+        }
+        break;
+    case ShapeKind::Square:
+        for (size_t n = 0; n < count; ++n) {
+            int i = slots[n];
+            canvas.owner = scene.ids[i];
+            Square::draw(canvas, scene.xs[i], scene.ys[i], scene.widths[i], scene.outlines[i], scene.fills[i], scene.filled[i] != 0);
+        }
+        break;
+    case ShapeKind::Triangle:
+        for (size_t n = 0; n < count; ++n) {
+            int i = slots[n];
+            canvas.owner = scene.ids[i];
+            Triangle::draw(canvas, scene.xs[i], scene.ys[i], scene.widths[i], scene.outlines[i], scene.fills[i], scene.filled[i] != 0);
+        }
+        break;
+    case ShapeKind::Line:
+        for (size_t n = 0; n < count; ++n) {
+            int i = slots[n];
+            canvas.owner = scene.ids[i];
+            Line::draw(canvas, scene.xs[i], scene.ys[i], scene.widths[i], scene.outlines[i], scene.fills[i], scene.filled[i] != 0);
+        }
+        break;
+    }
+}
+
+// Draws the given slots in the order listed, splitting them into runs of the same kind.
+void DrawSlots(const Canvas& canvas, const Scene& scene, const std::vector<int>& slots) {
+    size_t start = 0;
+    while (start < slots.size()) {
+        ShapeKind kind = scene.kinds[slots[start]];
+        size_t end = start + 1;
+        while (end < slots.size() && scene.kinds[slots[end]] == kind) ++end;
+        DrawBatch(canvas, scene, kind, slots.data() + start, end - start);
+        start = end;
+    }
+}
+
+// Largest render pool the threads command and --threads accept.
+int MaxRenderThreads() {
+    return MAX_THREADS_PER_CORE * static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+bool ValidThreadCount(int threads) {
+    return threads > 0 && threads <= MaxRenderThreads();
+}
+
+// Fixed set of workers for data-parallel loops. parallelFor deals the indices out round-robin to one
+// deque per worker (plus one for the calling thread). Everyone drains their own deque from the front
+// and, once it is empty, steals from the back of the others, so uneven tiles still balance out.
+struct ThreadPool {
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> items;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues;
+    const std::function<void(size_t)>* body = nullptr;
+    std::atomic<size_t> remaining{ 0 };
+    std::mutex state_lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    unsigned long long generation = 0;
+    bool stopping = false;
+
+    // threads counts the calling thread, so ThreadPool(1) never starts a worker.
+    explicit ThreadPool(int threads) {
+        threads = std::max(1, threads);
+        for (int i = 0; i < threads; ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (int i = 1; i < threads; ++i) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const { return static_cast<int>(queues.size()); }
+
+    // Runs fn(0) .. fn(count - 1) across the pool and returns when all of them have finished.
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn) {
+        if (count == 0) return;
+        if (workers.empty() || count == 1) {
+            for (size_t i = 0; i < count; ++i) fn(i);
+            return;
+        }
+
+        // Publish the job before any index becomes visible: a worker still draining the previous
+        // job may pick one up as soon as it lands in a queue.
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            body = &fn;
+            remaining = count;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Queue& queue = *queues[i % queues.size()];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.items.push_back(i);
+        }
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            ++generation;
+        }
+        wake.notify_all();
+
+        while (runOne(0)) {}
+
+        std::unique_lock<std::mutex> guard(state_lock);
+        done.wait(guard, [this] { return remaining == 0; });
+        body = nullptr;
+    }
+
+    bool takeWork(size_t self, size_t& item) {
+        {
+            Queue& own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.items.empty()) {
+                item = own.items.front();
+                own.items.pop_front();
+                return true;
+            }
+        }
+        for (size_t n = 1; n < queues.size(); ++n) {
+            Queue& victim = *queues[(self + n) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.items.empty()) {
+                item = victim.items.back();
+                victim.items.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool runOne(size_t self) {
+        size_t item;
+        if (!takeWork(self, item)) return false;
+        (*body)(item);
+        if (remaining.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> guard(state_lock);
+            done.notify_all();
+        }
+        return true;
+    }
+
+    void workerLoop(size_t self) {
+        unsigned long long seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(state_lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            while (runOne(self)) {}
+        }
+    }
+};
+
+// Repaints only the cells inside damage: shapes whose bounds intersect it are redrawn in z-order, clipped to it.
+// layer picks what is drawn, as in Scene::drawnIn; -1 is the whole visible scene.
+void RedrawRegion(Board& board, const Scene& scene, const Rect& damage, int layer = -1) {
+    SHAPES_STAT_TIME(render_stats.region_redraw);
+    Rect region = damage.intersected(board.bounds());
+    if (region.empty()) return;
+
+    board.clear(region);
+    static thread_local std::vector<int> slots;
+    scene.drawOrder(region, layer, slots);
+    DrawSlots(Canvas(board, region), scene, slots);
+}
+
+// A shape changed from footprint before to footprint after; repaint both without touching the rest of the board.
+void RedrawChange(Board& board, const Scene& scene, const Rect& before, const Rect& after, int layer = -1) {
+    if (before.intersects(after)) {
+        RedrawRegion(board, scene, before.united(after), layer);
+    }
+    else {
+        RedrawRegion(board, scene, before, layer);
+        RedrawRegion(board, scene, after, layer);
+    }
+}
+
+void RedrawAllSerial(Board& board, const Scene& scene, int layer = -1) {
+    board.clear();
+    static thread_local std::vector<int> slots;
+    scene.drawOrder(layer, slots);
+    DrawSlots(Canvas(board), scene, slots);
+}
+
+// Splits the board into RENDER_TILE_SIZE tiles and lets the pool render them independently. Each tile
+// clears itself and draws, in z-order, only the shapes the index reports for it, clipped to the tile.
+// Tiles never share cells, so the board needs no locking and the result matches the serial path.
+void RedrawAllTiled(Board& board, const Scene& scene, ThreadPool& pool, int layer = -1) {
+    int tile_cols = (board.width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    int tile_rows = (board.height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+
+    pool.parallelFor(static_cast<size_t>(tile_cols) * tile_rows, [&](size_t tile) {
+        int tx = static_cast<int>(tile % tile_cols) * RENDER_TILE_SIZE;
+        int ty = static_cast<int>(tile / tile_cols) * RENDER_TILE_SIZE;
+        Rect region = Rect{ tx, ty, tx + RENDER_TILE_SIZE, ty + RENDER_TILE_SIZE }.intersected(board.bounds());
+
+        board.clear(region);
+        static thread_local std::vector<int> slots;
+        scene.drawOrder(region, layer, slots);
+        DrawSlots(Canvas(board, region), scene, slots);
+        });
+}
+
+// A full redraw is also when a tiled board frees the tiles that its shapes no longer cover.
+void RedrawAll(Board& board, const Scene& scene, ThreadPool& pool, int layer = -1) {
+    SHAPES_STAT_TIME(render_stats.full_redraw);
+    if (pool.size() > 1 && board.width * static_cast<long long>(board.height) > RENDER_TILE_SIZE * RENDER_TILE_SIZE) {
+        RedrawAllTiled(board, scene, pool, layer);
+    }
+    else {
+        RedrawAllSerial(board, scene, layer);
+    }
+    board.compact();
+}
+
+// Renders area of the scene into target, which must be area's size, from only the shapes the
+// index finds there. The cost follows what is inside area, not the size of the scene or board.
+void RenderView(Board& target, const Scene& scene, const Rect& area) {
+    target.clear();
+    static thread_local std::vector<int> slots;
+    scene.drawOrder(area, -1, slots);
+    DrawSlots(Canvas(target, area, area.x0, area.y0), scene, slots);
+}
+
+// What one layer looks like on its own: its shapes over TRANSPARENT_CELL.
+struct LayerCache {
+    Board board;
+    bool dirty = true;  // out of date; rasterized again in full before its next use
+};
+
+// Rebuilds area of the board from the caches: each visible layer, bottom to top, covers the
+// cells below it wherever it is not transparent. Row bands are composited in parallel; a damage
+// rect of one band, the usual case for an edit, is done inline without going through the pool.
+// Bands sit on RENDER_TILE_SIZE boundaries of the board, so no two of them write to one tile.
+void CompositeLayers(Board& board, const Scene& scene, const std::vector<LayerCache>& caches, const Rect& damage, ThreadPool& pool) {
+    SHAPES_STAT_TIME(render_stats.composite);
+    Rect area = damage.intersected(board.bounds());
+    if (area.empty()) return;
+
+    int first_band = area.y0 / RENDER_TILE_SIZE;
+    int bands = (area.y1 - 1) / RENDER_TILE_SIZE - first_band + 1;
+    size_t width = static_cast<size_t>(area.x1 - area.x0);
+    auto compositeBand = [&](size_t band) {
+        static thread_local std::vector<char> line;
+        line.resize(width);
+        int band_y = (first_band + static_cast<int>(band)) * RENDER_TILE_SIZE;
+        int y0 = std::max(area.y0, band_y);
+        int y1 = std::min(area.y1, band_y + RENDER_TILE_SIZE);
+        for (int y = y0; y < y1; ++y) {
+            std::memset(line.data(), board.background, width);
+            for (int layer : scene.layer_order) {
+                if (!scene.layer_table[layer].visible) continue;
+                const Board& cache = caches[layer].board;
+                for (int x = area.x0; x < area.x1;) {
+                    int length;
+                    const char* in = cache.span(x, y, length);
+                    length = std::min(length, area.x1 - x);
+                    if (in) {
+                        char* out = line.data() + (x - area.x0);
+                        for (int i = 0; i < length; ++i) {
+                            out[i] = in[i] != TRANSPARENT_CELL ? in[i] : out[i];
+                        }
+                    }
+                    x += length;
+                }
+            }
+            board.writeRow(y, area.x0, area.x1, line.data());
+        }
+    };
+    if (bands == 1) compositeBand(0);
+    else pool.parallelFor(static_cast<size_t>(bands), compositeBand);
+}
+
+enum class PlaceResult : unsigned char {
+    Placed,
+    OutsideBoard,
+    Duplicate,      // same kind and size at the same anchor
+    Overlap,        // only with reject_overlap
+    NoIds           // every id up to MAX_SHAPE_ID has been handed out
+};
+
+const char* PlaceResultMessage(PlaceResult result) {
+    switch (result) {
+    case PlaceResult::OutsideBoard: return "Shape doesn't fit on the board.";
+    case PlaceResult::Duplicate: return "Shape with the same type and parameters already exists at this location.";
+    case PlaceResult::Overlap: return "Shape overlaps an existing shape.";
+    case PlaceResult::NoIds: return "No shape IDs are left.";
+    default: return "";
+    }
+}
+
+PlaceResult CheckPlacement(const Board& board, const Information& shape, const Scene& scene) {
+    if (shape.id > MAX_SHAPE_ID) return PlaceResult::NoIds;
+    if (!ValidShapeGeometry(shape)) return PlaceResult::OutsideBoard;
+    int x = shape.x;
+    int y = shape.y;
+    if (!ShapeFits(board, shape.type, x, y, shape.width)) return PlaceResult::OutsideBoard;
+
+    bool duplicate = scene.index.any({ x, y, x + 1, y + 1 }, [&](const SpatialIndex::Entry& entry) {
+        if (entry.x != x || entry.y != y) return false;
+        int slot = scene.find(entry.id);
+        return scene.kinds[slot] == shape.type && scene.widths[slot] == shape.width && scene.heights[slot] == shape.height;
+        });
+    if (duplicate) return PlaceResult::Duplicate;
+
+    Rect bounds = ShapeBounds(shape.type, x, y, shape.width);
+    if (scene.reject_overlap && !bounds.empty() && scene.overlaps(bounds, -1)) return PlaceResult::Overlap;
+    return PlaceResult::Placed;
+}
+
+bool PlaceShape(const Board& board, const Information& shape, const Scene& scene) {
+    PlaceResult result = CheckPlacement(board, shape, scene);
+    if (result != PlaceResult::Placed) std::cout << PlaceResultMessage(result) << "\n";
+    return result == PlaceResult::Placed;
+}
+
+// Adds a batch of shapes on top of the scene, accepting exactly what placing them one by one
+// would, without printing anything. results[i] says what became of shapes[i]; accepted shapes get
+// ids in a block from next_id, in batch order, written back into shapes[i].id, and slots receives
+// their slots bottom to top. Every shape is checked against the board and the scene as it was in
+// one pass over the batch; duplicates within the batch are found by sorting it, keeping the first
+// of each run. With reject_overlap, whether a shape is accepted depends on which ones before it
+// were, so those checks are instead repeated as each shape is inserted. Returns the number accepted.
+size_t InsertShapes(const Board& board, Scene& scene, std::vector<Information>& shapes, int& next_id,
+    std::vector<PlaceResult>& results, std::vector<int>& slots) {
+    // Anchor and parameters copied out of the batch, so the sort compares keys held side by side
+    // instead of chasing indices back into it. The anchor is packed into one word; kind, width and
+    // height stay separate, since together they take more bits than a word has left.
+    struct PlacementKey {
+        uint64_t anchor;
+        ShapeKind type;
+        int width;
+        int height;
+        int index;
+
+        bool sameShape(const PlacementKey& other) const {
+            return anchor == other.anchor && type == other.type && width == other.width && height == other.height;
+        }
+    };
+
+    results.resize(shapes.size());
+    std::vector<PlacementKey> keys;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        const Information& s = shapes[i];
+        results[i] = CheckPlacement(board, s, scene);
+        if (results[i] != PlaceResult::Placed || scene.reject_overlap) continue;
+        if (keys.empty()) keys.reserve(shapes.size() - i);
+        keys.push_back({ static_cast<uint64_t>(static_cast<uint32_t>(s.y)) << 32 | static_cast<uint32_t>(s.x),
+            s.type, s.width, s.height, static_cast<int>(i) });
+    }
+
+    std::sort(keys.begin(), keys.end(), [](const PlacementKey& a, const PlacementKey& b) {
+        if (a.anchor != b.anchor) return a.anchor < b.anchor;
+        if (a.type != b.type) return a.type < b.type;
+        if (a.width != b.width) return a.width < b.width;
+        if (a.height != b.height) return a.height < b.height;
+        return a.index < b.index;
+        });
+    for (size_t n = 1; n < keys.size(); ++n) {
+        if (keys[n].sameShape(keys[n - 1])) {
+            results[keys[n].index] = PlaceResult::Duplicate;
+        }
+    }
+
+    size_t accepted = 0;
+    for (PlaceResult result : results) accepted += result == PlaceResult::Placed;
+    scene.reserve(scene.size() + accepted);
+    scene.reserveIds(static_cast<int>(std::min<long long>(static_cast<long long>(next_id) + accepted, MAX_SHAPE_ID)));
+    slots.clear();
+    slots.reserve(accepted);
+
+    accepted = 0;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (results[i] != PlaceResult::Placed) continue;
+        Information& shape = shapes[i];
+        if (next_id > MAX_SHAPE_ID) {
+            results[i] = PlaceResult::NoIds;
+            continue;
+        }
+        if (scene.reject_overlap) {
+            results[i] = CheckPlacement(board, shape, scene);
+            if (results[i] != PlaceResult::Placed) continue;
+        }
+        shape.id = next_id++;
+        slots.push_back(static_cast<int>(scene.size()));
+        scene.add(shape);
+        ++accepted;
+    }
+    return accepted;
+}
+
+// Read-only view of a whole file mapped into memory.
+struct MappedFile {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length)) return false;
+        size = static_cast<size_t>(length.QuadPart);
+        if (size == 0) return true;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return false;
+        data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        return data != nullptr;
+#else
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0) return false;
+        size = static_cast<size_t>(info.st_size);
+        if (size == 0) return true;
+        void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED) return false;
+        data = static_cast<const unsigned char*>(view);
+        madvise(view, size, MADV_SEQUENTIAL);
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap(const_cast<unsigned char*>(data), size);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// The binary scene format is little-endian regardless of the host.
+inline void PutLE32(unsigned char* out, uint32_t value) {
+    out[0] = static_cast<unsigned char>(value);
+    out[1] = static_cast<unsigned char>(value >> 8);
+    out[2] = static_cast<unsigned char>(value >> 16);
+    out[3] = static_cast<unsigned char>(value >> 24);
+}
+
+inline void PutLE64(unsigned char* out, uint64_t value) {
+    PutLE32(out, static_cast<uint32_t>(value));
+    PutLE32(out + 4, static_cast<uint32_t>(value >> 32));
+}
+
+inline uint32_t GetLE32(const unsigned char* in) {
+    return static_cast<uint32_t>(in[0]) | static_cast<uint32_t>(in[1]) << 8 |
+        static_cast<uint32_t>(in[2]) << 16 | static_cast<uint32_t>(in[3]) << 24;
+}
+
+inline uint64_t GetLE64(const unsigned char* in) {
+    return static_cast<uint64_t>(GetLE32(in)) | static_cast<uint64_t>(GetLE32(in + 4)) << 32;
+}
+
+bool IsBinarySceneName(const std::string& filename) {
+    return filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0;
+}
+
+// Layer names are stored as single words in both file formats.
+bool ValidLayerName(const std::string& name) {
+    if (name.empty() || name.size() > MAX_LAYER_NAME) return false;
+    for (char c : name) {
+        if (static_cast<unsigned char>(c) <= ' ') return false;
+    }
+    return true;
+}
+
+// Makes the scene's layer with this name, created if needed, the one at position in the stack.
+// Loading calls it for the layers of a file in order, so they end up stacked as they were saved.
+int AdoptLayer(Scene& scene, const std::string& name, bool visible, int position) {
+    int layer = scene.findLayer(name);
+    if (layer < 0) layer = scene.addLayer(name);
+    scene.layer_table[layer].visible = visible;
+    scene.moveLayer(layer, std::min(position, static_cast<int>(scene.layer_order.size()) - 1));
+    return layer;
+}
+
+// Puts the stack back as a new scene has it, for files that carry no layers: every layer shown,
+// in the order it was made, so base, which holds the file's shapes, is at the bottom. Layers are
+// never deleted; the other ones are empty after the clear that comes before loading.
+void ResetLayers(Scene& scene) {
+    for (size_t layer = 0; layer < scene.layer_table.size(); ++layer) {
+        scene.layer_table[layer].visible = true;
+        scene.moveLayer(static_cast<int>(layer), static_cast<int>(layer));
+    }
+}
+
+// Header: magic "SHPB", version, board width, board height (u32 each), shape count (u64),
+// layer count (u32), 4 reserved bytes.
+// Then one 28-byte record per shape in drawing order:
+// id (i32), kind, outline, fill, filled (u8 each), x, y, width, height, layer (i32 each).
+// The layer is an index into the layer table that follows the records: one entry per layer,
+// bottom to top, of flags (u8, bit 0 set if visible), name length (u8) and the name.
+// Colours are palette indices. Version 2 files store them as glyphs, and version 1 files also
+// have 24-byte records without the layer and no layer table.
+// Returns false if the file could not be written, as do the other save functions.
+bool saveBinaryFile(const std::string& filename, int width, int height, const Scene& scene) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) return false;
+
+    unsigned char header[SCENE_HEADER_SIZE] = {};
+    std::memcpy(header, SCENE_FILE_MAGIC, 4);
+    PutLE32(header + 4, SCENE_FILE_VERSION);
+    PutLE32(header + 8, static_cast<uint32_t>(width));
+    PutLE32(header + 12, static_cast<uint32_t>(height));
+    PutLE64(header + 16, scene.size());
+    PutLE32(header + 24, static_cast<uint32_t>(scene.layer_order.size()));
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    // Records are packed into a fixed buffer and written a chunk at a time.
+    const size_t records_per_chunk = 16384;
+    std::vector<unsigned char> chunk(records_per_chunk * SCENE_RECORD_SIZE);
+    size_t used = 0;
+    scene.forEachInOrder([&](size_t slot) {
+        unsigned char* out = chunk.data() + used;
+        PutLE32(out, static_cast<uint32_t>(scene.ids[slot]));
+        out[4] = static_cast<unsigned char>(scene.kinds[slot]);
+        out[5] = static_cast<unsigned char>(scene.outlines[slot]);
+        out[6] = static_cast<unsigned char>(scene.fills[slot]);
+        out[7] = scene.filled[slot];
+        PutLE32(out + 8, static_cast<uint32_t>(scene.xs[slot]));
+        PutLE32(out + 12, static_cast<uint32_t>(scene.ys[slot]));
+        PutLE32(out + 16, static_cast<uint32_t>(scene.widths[slot]));
+        PutLE32(out + 20, static_cast<uint32_t>(scene.heights[slot]));
+        PutLE32(out + 24, static_cast<uint32_t>(scene.layer_table[scene.layers[slot]].position));
+        used += SCENE_RECORD_SIZE;
+        if (used == chunk.size()) {
+            file.write(reinterpret_cast<const char*>(chunk.data()), used);
+            used = 0;
+        }
+        });
+    file.write(reinterpret_cast<const char*>(chunk.data()), used);
+
+    for (int layer : scene.layer_order) {
+        const SceneLayer& entry = scene.layer_table[layer];
+        unsigned char prefix[2] = { static_cast<unsigned char>(entry.visible ? 1 : 0), static_cast<unsigned char>(entry.name.size()) };
+        file.write(reinterpret_cast<const char*>(prefix), 2);
+        file.write(entry.name.data(), entry.name.size());
+    }
+    file.close();
+    return !file.fail();
+}
+
+// Maps the file and fills the scene straight from the fixed-size records. The board takes the size
+// stored in the header. Returns false, leaving everything untouched, if the file is not a valid scene.
+bool loadBinaryFile(const std::string& filename, Board& board, Scene& scene, int& shape_id) {
+    MappedFile mapped;
+    if (!mapped.open(filename)) {
+        std::cerr << "Could not open the file";
+        return false;
+    }
+
+    const unsigned char* data = mapped.data;
+    if (mapped.size < SCENE_HEADER_SIZE || std::memcmp(data, SCENE_FILE_MAGIC, 4) != 0) {
+        std::cerr << "Not a binary scene file\n";
+        return false;
+    }
+    uint32_t version = GetLE32(data + 4);
+    if (version < 1 || version > SCENE_FILE_VERSION) {
+        std::cerr << "Unsupported scene file version " << version << "\n";
+        return false;
+    }
+
+    size_t record_size = version == 1 ? SCENE_RECORD_SIZE_V1 : SCENE_RECORD_SIZE;
+    int width = static_cast<int>(GetLE32(data + 8));
+    int height = static_cast<int>(GetLE32(data + 12));
+    uint64_t count = GetLE64(data + 16);
+    uint32_t layer_count = version == 1 ? 0 : GetLE32(data + 24);
+    size_t body = mapped.size - SCENE_HEADER_SIZE;
+    if (!ValidBoardSize(width, height) || count > body / record_size || (version == 1 && body % record_size != 0)) {
+        std::cerr << "Corrupt scene file\n";
+        return false;
+    }
+
+    // Layer table: names and visibility, bottom to top.
+    struct FileLayer {
+        std::string name;
+        bool visible;
+    };
+    std::vector<FileLayer> file_layers;
+    const unsigned char* table = data + SCENE_HEADER_SIZE + count * record_size;
+    const unsigned char* end = data + mapped.size;
+    for (uint32_t i = 0; i < layer_count; ++i) {
+        if (end - table < 2 || end - table - 2 < table[1]) {
+            std::cerr << "Corrupt layer table in scene file\n";
+            return false;
+        }
+        FileLayer layer = { std::string(reinterpret_cast<const char*>(table + 2), table[1]), (table[0] & 1) != 0 };
+        if (!ValidLayerName(layer.name)) {
+            std::cerr << "Corrupt layer table in scene file\n";
+            return false;
+        }
+        file_layers.push_back(layer);
+        table += 2 + table[1];
+    }
+    if (table != end) {
+        std::cerr << "Corrupt scene file\n";
+        return false;
+    }
+
+    const unsigned char* records = data + SCENE_HEADER_SIZE;
+    uint32_t max_id = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        const unsigned char* in = records + i * record_size;
+        Information geometry(0, ShapeKind::Circle, static_cast<int>(GetLE32(in + 8)), static_cast<int>(GetLE32(in + 12)),
+            static_cast<int>(GetLE32(in + 16)), static_cast<int>(GetLE32(in + 20)));
+        if (in[4] > static_cast<unsigned char>(ShapeKind::Line) || GetLE32(in) > static_cast<uint32_t>(MAX_SHAPE_ID) ||
+            !ValidShapeGeometry(geometry) || (version > 1 && GetLE32(in + 24) >= std::max<uint32_t>(layer_count, 1))) {
+            std::cerr << "Corrupt record " << i << " in scene file\n";
+            return false;
+        }
+        max_id = std::max(max_id, GetLE32(in));
+    }
+    // Two records with one id would both be linked into the depth order.
+    std::vector<bool> seen(count ? max_id + 1 : 0);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t id = GetLE32(records + i * record_size);
+        if (seen[id]) {
+            std::cerr << "Duplicate shape id " << id << " in record " << i << " of scene file\n";
+            return false;
+        }
+        seen[id] = true;
+    }
+
+    if (board.width != width || board.height != height) {
+        board = Board(width, height);
+    }
+    scene.clear();
+    scene.rebuildIndex(board);
+    scene.reserve(static_cast<size_t>(count));
+
+    std::vector<int> layer_ids(std::max<size_t>(file_layers.size(), 1), 0);
+    for (size_t i = 0; i < file_layers.size(); ++i) {
+        layer_ids[i] = AdoptLayer(scene, file_layers[i].name, file_layers[i].visible, static_cast<int>(i));
+    }
+    if (file_layers.empty()) ResetLayers(scene);
+
+    for (uint64_t i = 0; i < count; ++i) {
+        const unsigned char* in = records + i * record_size;
+        Information info(static_cast<int>(GetLE32(in)), static_cast<ShapeKind>(in[4]),
+            static_cast<int>(GetLE32(in + 8)), static_cast<int>(GetLE32(in + 12)),
+            static_cast<int>(GetLE32(in + 16)), static_cast<int>(GetLE32(in + 20)),
+            static_cast<char>(in[5]), static_cast<char>(in[6]), in[7] != 0);
+        if (version < 3) {
+            info.outline = palette.from_glyph[in[5]];
+            info.fill = palette.from_glyph[in[6]];
+        }
+        if (version > 1) info.layer = layer_ids[GetLE32(in + 24)];
+        scene.add(info);
+        shape_id = std::max(shape_id, info.id + 1);
+    }
+    return true;
+}
+
+bool IsBinarySceneFile(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    char magic[4] = {};
+    file.read(magic, 4);
+    return file && std::memcmp(magic, SCENE_FILE_MAGIC, 4) == 0;
+}
+
+// One record per line, ending in "hollow" for a circle, square or triangle drawn without its
+// fill. A scene with layers other than a single visible one writes each layer as a
+// "layer name [hidden]" line, bottom to top, followed by the records of its shapes.
+bool saveTextFile(const std::string& filename, const Scene& scene) {
+    std::ofstream file(filename);
+    if (!file) return false;
+
+    auto writeShape = [&](size_t slot) {
+        Information info = scene.get(slot);
+        file << info.id << " " << KindName(info.type) << " " << info.x << " " << info.y << " "
+            << info.width << " " << info.height << " "
+            << ColorLabel(info.outline) << " " << ColorLabel(info.fill)
+            << (info.filled || info.type == ShapeKind::Line ? "" : " hollow") << "\n";
+    };
+
+    if (!scene.layered() && scene.layer_table[0].visible) {
+        scene.forEachInOrder(writeShape);
+    }
+    else {
+        for (int layer : scene.layer_order) {
+            file << "layer " << scene.layer_table[layer].name << (scene.layer_table[layer].visible ? "" : " hidden") << "\n";
+            scene.forEachInOrder([&](size_t slot) {
+                if (scene.layers[slot] == layer) writeShape(slot);
+                });
+        }
+    }
+    file.close();
+    return !file.fail();
+}
+
+inline bool IsBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* SkipBlanks(const char* p, const char* end) {
+    while (p < end && IsBlank(*p)) ++p;
+    return p;
+}
+
+inline bool ParseInt(const char*& p, const char* end, int& value) {
+    p = SkipBlanks(p, end);
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec != std::errc() || (result.ptr < end && !IsBlank(*result.ptr))) return false;
+    p = result.ptr;
+    return true;
+}
+
+// Parses one "id type x y width height outline fill [hollow]" record. The colour fields are
+// ColorLabels, and the fill of a line is saved as a space, so the fill is the label one blank after
+// the outline. Records without "hollow", as all older files are, are filled; lines never are.
+bool ParseShapeLine(const char* p, const char* end, Information& info) {
+    if (!ParseInt(p, end, info.id) || info.id < 0 || info.id > MAX_SHAPE_ID) return false;
+
+    p = SkipBlanks(p, end);
+    const char* name = p;
+    while (p < end && !IsBlank(*p)) ++p;
+    if (!KindFromName(std::string(name, p), info.type)) return false;
+
+    if (!ParseInt(p, end, info.x) || !ParseInt(p, end, info.y) ||
+        !ParseInt(p, end, info.width) || !ParseInt(p, end, info.height)) return false;
+    if (info.width < 0 || info.height < 0 || !ValidShapeGeometry(info)) return false;
+
+    p = SkipBlanks(p, end);
+    if (p == end) return false;
+    const char* label = p;
+    while (p < end && !IsBlank(*p)) ++p;
+    if (!ParseColorLabel(std::string_view(label, p - label), info.outline)) return false;
+    info.fill = BACKGROUND_CELL;
+    if (p + 1 < end && IsBlank(*p) && !IsBlank(p[1])) {
+        label = ++p;
+        while (p < end && !IsBlank(*p)) ++p;
+        if (!ParseColorLabel(std::string_view(label, p - label), info.fill)) return false;
+    }
+    p = SkipBlanks(p, end);
+    bool hollow = std::string_view(p, end - p) == "hollow";
+    if (p != end && !hollow) return false;
+
+    info.filled = !hollow && info.type != ShapeKind::Line;
+    return true;
+}
+
+// Parses a "layer name [hidden]" line. Returns false if the line is not one.
+bool ParseLayerLine(const char* p, const char* end, std::string& name, bool& visible) {
+    const char keyword[] = "layer";
+    const size_t keyword_length = sizeof(keyword) - 1;
+    p = SkipBlanks(p, end);
+    if (static_cast<size_t>(end - p) <= keyword_length || std::memcmp(p, keyword, keyword_length) != 0 || !IsBlank(p[keyword_length])) {
+        return false;
+    }
+
+    p = SkipBlanks(p + keyword_length, end);
+    const char* name_begin = p;
+    while (p < end && !IsBlank(*p)) ++p;
+    name.assign(name_begin, p);
+
+    p = SkipBlanks(p, end);
+    const char* flag = p;
+    while (p < end && !IsBlank(*p)) ++p;
+    visible = flag == p;
+    if (!visible && std::string_view(flag, p - flag) != "hidden") return false;
+    return SkipBlanks(p, end) == end && ValidLayerName(name);
+}
+
+// Hands out the lines of a file one at a time through a fixed buffer, so memory stays at one
+// chunk however big the input is. A line longer than the whole buffer is returned once, flagged
+// as too long, with only its tail in view.
+struct LineReader {
+    std::FILE* file;
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    long long line_number = 0;
+    bool at_eof = false;
+    bool skipping = false;
+
+    explicit LineReader(std::FILE* source, size_t chunk = TEXT_LOAD_CHUNK) : file(source), buffer(chunk) {}
+
+    bool next(const char*& line_begin, const char*& line_end, bool& too_long) {
+        while (true) {
+            char* data = buffer.data();
+            const char* newline = static_cast<const char*>(std::memchr(data + begin, '\n', end - begin));
+            if (newline || (at_eof && (begin < end || skipping))) {
+                line_begin = data + begin;
+                line_end = newline ? newline : data + end;
+                begin = newline ? newline - data + 1 : end;
+                too_long = skipping;
+                skipping = false;
+                ++line_number;
+                return true;
+            }
+            if (at_eof) return false;
+
+            if (begin == 0 && end == buffer.size()) {
+                skipping = true;
+                end = 0;
+            }
+            else {
+                std::memmove(data, data + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            size_t got = std::fread(data + end, 1, buffer.size() - end, file);
+            end += got;
+            at_eof = got == 0;
+        }
+    }
+};
+
+// Streams the file through a LineReader. Bad records are reported with their line number and
+// skipped; the rest of the file still loads. Returns false only if the file could not be opened.
+bool loadTextFile(const std::string& filename, Scene& scene, int& shape_id) {
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Could not open the file";
+        return false;
+    }
+
+    scene.clear();
+
+    LineReader reader(file);
+    long long bad_lines = 0;
+    auto report = [&](const char* reason) {
+        std::cerr << filename << ":" << reader.line_number << ": " << reason << "\n";
+        ++bad_lines;
+    };
+
+    // Records before the first layer line belong to layer 0.
+    int layer = 0;
+    int layers_seen = 0;
+    std::string layer_name;
+    bool layer_visible;
+
+    const char* begin;
+    const char* end;
+    bool too_long;
+    while (reader.next(begin, end, too_long)) {
+        if (too_long) {
+            report("line too long");
+            continue;
+        }
+        if (SkipBlanks(begin, end) == end) continue;
+
+        if (ParseLayerLine(begin, end, layer_name, layer_visible)) {
+            layer = AdoptLayer(scene, layer_name, layer_visible, layers_seen++);
+            continue;
+        }
+
+        Information info;
+        if (!ParseShapeLine(begin, end, info)) {
+            report("malformed record");
+            continue;
+        }
+        info.layer = layer;
+        if (scene.find(info.id) >= 0) {
+            report("duplicate shape id");
+            continue;
+        }
+        scene.add(info);
+        shape_id = std::max(shape_id, info.id + 1);
+    }
+
+    std::fclose(file);
+    if (layers_seen == 0) ResetLayers(scene);
+    if (bad_lines > 0) {
+        std::cerr << "Skipped " << bad_lines << " bad line" << (bad_lines == 1 ? "" : "s") << " in " << filename << "\n";
+    }
+    return true;
+}
+
+bool saveScene(const std::string& path, bool binary, int width, int height, const Scene& scene) {
+    SHAPES_STAT_TIME(render_stats.save);
+    return binary ? saveBinaryFile(path, width, height, scene) : saveTextFile(path, scene);
+}
+
+// Files named *.bin are written in the binary format, anything else as text.
+void saveToFile(const std::string& filename, const Board& board, const Scene& scene) {
+    if (!saveScene(filename, IsBinarySceneName(filename), board.width, board.height, scene)) {
+        std::cerr << "Could not save the file";
+    }
+}
+
+// The format is detected from the file's first bytes, whatever its name. Returns true if the
+// scene was replaced; the caller redraws the board.
+bool loadFromFile(const std::string& filename, Board& board, Scene& scene, int& shape_id) {
+    SHAPES_STAT_TIME(render_stats.load);
+    if (IsBinarySceneFile(filename)) {
+        return loadBinaryFile(filename, board, scene, shape_id);
+    }
+    return loadTextFile(filename, scene, shape_id);
+}
+
+// Moves from over to, replacing it. Windows will not rename over an existing file, so there the
+// old one is removed first.
+bool RenameOver(const std::string& from, const std::string& to) {
+    if (std::rename(from.c_str(), to.c_str()) == 0) return true;
+    std::remove(to.c_str());
+    return std::rename(from.c_str(), to.c_str()) == 0;
+}
+
+// Flushes the stream and waits until what was written is on the disk.
+bool SyncFile(std::FILE* file) {
+    if (std::fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// On POSIX systems a rename is only durable once the directory holding the file is synced too.
+void SyncDirectoryOf(const std::string& path) {
+#ifdef _WIN32
+    (void)path;
+#else
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    ::close(fd);
+#endif
+}
+
+// What a background save writes: the shape store as it was when the save was asked for, and the
+// board size. The index is not copied; nothing that saves needs it.
+struct SavedScene {
+    int width = 0;
+    int height = 0;
+    Scene scene{ Board(1, 1) };
+};
+
+// Writes scenes to disk on a thread of its own, so a save never blocks the command loop. The
+// caller's only cost is a copy-on-write SavedScene, which takes constant time, and the worker
+// writes that copy while editing carries on. Each file is written under a temporary name and
+// renamed over the old one, so an interrupted save never leaves a torn file behind. Outcomes queue up
+// until the front end collects them, before its next prompt. An autosave that is still waiting
+// when the next one is asked for is refreshed in place rather than queued again.
+struct BackgroundSaver {
+    struct Job {
+        std::string filename;
+        std::unique_ptr<SavedScene> saved;
+        bool autosave = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<Job> jobs;
+    std::vector<std::string> outcomes;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker;
+
+    BackgroundSaver() : worker([this] { run(); }) {}
+
+    // Finishes every queued save before returning.
+    ~BackgroundSaver() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    void save(const std::string& filename, int width, int height, const Scene& scene, bool autosave) {
+        SHAPES_STAT_TIME(render_stats.snapshot);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (autosave) {
+            for (Job& job : jobs) {
+                if (job.autosave && job.filename == filename) {
+                    copy(*job.saved, width, height, scene);
+                    return;
+                }
+            }
+        }
+        jobs.push_back({ filename, std::make_unique<SavedScene>(), autosave });
+        copy(*jobs.back().saved, width, height, scene);
+        wake.notify_one();
+    }
+
+    // Waits until every save asked for so far is on disk, or has failed.
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return jobs.empty() && !busy; });
+    }
+
+    // Moves the messages of finished saves into messages. Returns false if there are none.
+    bool takeOutcomes(std::vector<std::string>& messages) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (outcomes.empty()) return false;
+        messages.swap(outcomes);
+        outcomes.clear();
+        return true;
+    }
+
+private:
+    static void copy(SavedScene& saved, int width, int height, const Scene& scene) {
+        saved.width = width;
+        saved.height = height;
+        saved.scene.assignShapes(scene);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+
+            const SavedScene& saved = *job.saved;
+            std::string temporary = job.filename + ".tmp";
+            bool written = saveScene(temporary, IsBinarySceneName(job.filename), saved.width, saved.height, saved.scene) &&
+                RenameOver(temporary, job.filename);
+            if (!written) std::remove(temporary.c_str());
+            std::string message = (written ? "Saved " : "Could not save ") + job.filename;
+            if (written) {
+                message += " (" + std::to_string(saved.scene.size()) + (saved.scene.size() == 1 ? " shape" : " shapes") + ")";
+            }
+            if (job.autosave) message = "Autosave: " + message;
+            // Frees the chunks only this copy still holds outside the lock.
+            job.saved.reset();
+
+            lock.lock();
+            outcomes.push_back(std::move(message));
+            busy = false;
+            if (jobs.empty()) idle.notify_all();
+        }
+    }
+};
+
+// A colour name from the palette or #rrggbb, as a palette index.
+char Color(const std::string& color) {
+    for (int i = FIRST_NAMED_COLOR; i < palette.named_end; ++i) {
+        if (color == palette.entries[i].name) return static_cast<char>(i);
+    }
+    char hex;
+    if (ParseHexColor(color, hex)) return hex;
+    std::cerr << "This color is absent\n";
+    return UNKNOWN_COLOR;
+}
+
+enum class CommandKind {
+    Draw,
+    Triangle,
+    Circle,
+    Square,
+    Line,
+    Remove,
+    Paint,
+    Save,
+    Load,
+    Clear,
+    Exit,
+    Undo,
+    Redo,
+    History,
+    List,
+    Shapes,
+    Select,
+    Resize,
+    Threads,
+    Ansi,
+    Overlap,
+    Edit,
+    Move,
+    Stats,
+    Layer,
+    View,
+    Query,
+    Import,
+    Autosave,
+    Pick,
+    Owners
+};
+
+struct CommandName {
+    const char* name;
+    CommandKind kind;
+};
+
+// Listed in CommandKind order, so a kind indexes its own entry.
+const CommandName COMMAND_NAMES[] = {
+    { "draw", CommandKind::Draw },
+    { "triangle", CommandKind::Triangle },
+    { "circle", CommandKind::Circle },
+    { "square", CommandKind::Square },
+    { "line", CommandKind::Line },
+    { "remove", CommandKind::Remove },
+    { "paint", CommandKind::Paint },
+    { "save", CommandKind::Save },
+    { "load", CommandKind::Load },
+    { "clear", CommandKind::Clear },
+    { "exit", CommandKind::Exit },
+    { "undo", CommandKind::Undo },
+    { "redo", CommandKind::Redo },
+    { "history", CommandKind::History },
+    { "list", CommandKind::List },
+    { "shapes", CommandKind::Shapes },
+    { "select", CommandKind::Select },
+    { "resize", CommandKind::Resize },
+    { "threads", CommandKind::Threads },
+    { "ansi", CommandKind::Ansi },
+    { "overlap", CommandKind::Overlap },
+    { "edit", CommandKind::Edit },
+    { "move", CommandKind::Move },
+    { "stats", CommandKind::Stats },
+    { "layer", CommandKind::Layer },
+    { "view", CommandKind::View },
+    { "query", CommandKind::Query },
+    { "import", CommandKind::Import },
+    { "autosave", CommandKind::Autosave },
+    { "pick", CommandKind::Pick },
+    { "owners", CommandKind::Owners },
+};
+
+const int COMMAND_KIND_COUNT = static_cast<int>(sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]));
+
+LatencyHistogram command_latency[COMMAND_KIND_COUNT];
+uint64_t command_allocations[COMMAND_KIND_COUNT] = {};
+
+// Charges the heap allocations made while a command runs to that command.
+struct ScopedAllocationCount {
+    uint64_t& total;
+    uint64_t before;
+
+    explicit ScopedAllocationCount(uint64_t& target)
+        : total(target), before(allocation_counters.allocations.load(std::memory_order_relaxed)) {}
+    ~ScopedAllocationCount() { total += allocation_counters.allocations.load(std::memory_order_relaxed) - before; }
+};
+
+bool CommandFromName(std::string_view name, CommandKind& kind) {
+    for (const CommandName& entry : COMMAND_NAMES) {
+        if (name == entry.name) {
+            kind = entry.kind;
+            return true;
+        }
+    }
+    return false;
+}
+
+// One parsed command with its arguments. Which fields are used depends on the kind:
+// shapes use x, y, size, outline, fill and on; remove, paint, select, edit and move use id;
+// resize uses width and height; threads and history use value; edit uses property plus value or text;
+// layer uses text for the action, name, and value for a new position; view and query use x, y,
+// width and height; save, load and import use text for the filename; autosave uses value for
+// the interval and text for the filename; pick uses x, y and on for every shape rather than the
+// topmost; owners uses on.
+struct Command {
+    CommandKind kind = CommandKind::Draw;
+    int id = 0;
+    int x = 0;
+    int y = 0;
+    int size = 0;
+    int width = 0;
+    int height = 0;
+    int property = 0;
+    int value = 0;
+    bool on = false;
+    std::string outline;
+    std::string fill;
+    std::string text;
+    std::string name;
+};
+
+bool ParseCommand(const char* begin, const char* end, Command& command, const char*& error);
+
+bool SameShape(const Information& a, const Information& b) {
+    return a.id == b.id && a.type == b.type && a.x == b.x && a.y == b.y && a.width == b.width &&
+        a.height == b.height && a.outline == b.outline && a.fill == b.fill && a.filled == b.filled && a.layer == b.layer;
+}
+
+// The whole scene in depth order, keys included, plus the board size. Only taken for commands
+// that replace everything at once (clear, load); every other change is journaled as a delta.
+struct SceneSnapshot {
+    int width = 0;
+    int height = 0;
+    long long next_z_key = 0;
+    std::vector<Information> shapes;
+    std::vector<long long> keys;
+
+    SceneSnapshot() = default;
+    SceneSnapshot(const Board& board, const Scene& scene)
+        : width(board.width), height(board.height), next_z_key(scene.next_z_key) {
+        shapes.reserve(scene.size());
+        keys.reserve(scene.size());
+        scene.forEachInOrder([&](size_t slot) {
+            shapes.push_back(scene.get(slot));
+            keys.push_back(scene.z_key[scene.ids[slot]]);
+            });
+    }
+
+    size_t bytes() const {
+        return sizeof(*this) + shapes.capacity() * sizeof(Information) + keys.capacity() * sizeof(long long);
+    }
+};
+
+enum class JournalOp {
+    Add,        // after was added at depth (below, z_key)
+    Remove,     // before was removed from depth (below, z_key)
+    Change,     // shape went from before to after in place
+    Resize,     // board went from width/height_before to width/height_after
+    Replace,    // scene went from before_scene to after_scene
+    AddMany     // batch was added, in order, above below with keys from z_key
+};
+
+// One undoable step. Holds just enough to run the command either way, so undo and redo cost
+// as much as the change itself.
+struct JournalEntry {
+    JournalOp op = JournalOp::Change;
+    Information before;
+    Information after;
+    int below = -1;
+    long long z_key = 0;
+    int width_before = 0;
+    int height_before = 0;
+    int width_after = 0;
+    int height_after = 0;
+    std::unique_ptr<SceneSnapshot> before_scene;
+    std::unique_ptr<SceneSnapshot> after_scene;
+    std::vector<Information> batch;
+
+    size_t bytes() const {
+        return sizeof(*this) + (before_scene ? before_scene->bytes() : 0) + (after_scene ? after_scene->bytes() : 0) +
+            batch.capacity() * sizeof(Information);
+    }
+};
+
+// Double-ended queue over one growable array. Unlike std::deque it stops allocating once it has
+// reached its working size, however many items are pushed and popped after that.
+template <typename T>
+struct RingBuffer {
+    std::vector<T> items;
+    size_t head = 0;
+    size_t count = 0;
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    T& front() { return items[head]; }
+    T& back() { return items[(head + count - 1) % items.size()]; }
+
+    void push_back(T&& item) {
+        if (count == items.size()) grow();
+        items[(head + count) % items.size()] = std::move(item);
+        ++count;
+    }
+
+    void pop_front() {
+        items[head] = T();
+        head = (head + 1) % items.size();
+        --count;
+    }
+
+    void pop_back() {
+        back() = T();
+        --count;
+    }
+
+    void clear() {
+        while (count > 0) pop_back();
+        head = 0;
+    }
+
+private:
+    void grow() {
+        std::vector<T> larger(std::max<size_t>(16, items.size() * 2));
+        for (size_t i = 0; i < count; ++i) {
+            larger[i] = std::move(items[(head + i) % items.size()]);
+        }
+        items.swap(larger);
+        head = 0;
+    }
+};
+
+// Undo and redo stacks under a memory budget. Recording a new step drops the redo stack, and
+// the oldest steps are forgotten once the budget is exceeded.
+struct Journal {
+    RingBuffer<JournalEntry> done;
+    std::vector<JournalEntry> undone;
+    size_t bytes = 0;
+    size_t limit = DEFAULT_HISTORY_KIB * 1024;
+
+    void record(JournalEntry entry) {
+        for (const JournalEntry& step : undone) bytes -= step.bytes();
+        undone.clear();
+        bytes += entry.bytes();
+        done.push_back(std::move(entry));
+        trim();
+    }
+
+    void setLimit(size_t limit_bytes) {
+        limit = limit_bytes;
+        trim();
+    }
+
+    void trim() {
+        while (bytes > limit && !done.empty()) {
+            bytes -= done.front().bytes();
+            done.pop_front();
+        }
+        if (bytes > limit) {
+            for (const JournalEntry& step : undone) bytes -= step.bytes();
+            undone.clear();
+        }
+    }
+
+    void clear() {
+        done.clear();
+        undone.clear();
+        bytes = 0;
+    }
+};
+
+enum class LogRecord : unsigned char {
+    Checkpoint,     // shape id counter, layer table, scene
+    Insert,         // shape, below, z key
+    Erase,          // id
+    Update,         // the shape as it now is
+    Resize,         // width, height
+    Replace,        // layer table, scene
+    InsertMany,     // below, first z key, count, shapes in drawing order
+    EraseMany,      // count, ids in the order they were removed
+    LayerNew,       // name
+    LayerVisible,   // layer id, visible (u8)
+    LayerMove       // layer id, position
+};
+
+inline uint32_t Fnv1a(const unsigned char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Write-ahead log (--wal). Every change is appended to one file as a record of just that change,
+// so persisting an edit costs a few dozen bytes whatever the size of the scene. Records collect in
+// memory until commit writes and syncs them as one group: once per command at the prompt, once per
+// block in batch mode, once per writer batch in the server. Once compact_every records, or more
+// bytes than the last checkpoint, have been appended, the log is compacted: a checkpoint of the
+// whole session is written under a temporary name, synced and renamed over the log. Replay on
+// startup therefore never has more than one checkpoint and one interval of records to get through.
+// A crash loses at most the group being committed; replay stops at the first record that is cut
+// short or fails its checksum.
+//
+// File: magic "SHPL" and version (u32), then records of payload length (u64), FNV-1a checksum of
+// the payload (u32) and the payload: a LogRecord byte followed by its fields, little-endian.
+// Shapes are 28-byte records laid out as in the binary scene format, but with the layer id last.
+// A scene is board width and height (u32 each), next z key (u64), shape count (u64), then every
+// shape in drawing order, each followed by its z key (u64). A layer table is its length (u32) then,
+// for each layer id, visible (u8), position in the stack (u32), name length (u8) and name.
+struct WriteAheadLog {
+    std::string path;
+    std::FILE* file = nullptr;              // open for appending; null until a checkpoint succeeds
+    std::vector<unsigned char> pending;     // framed records not written yet
+    size_t record_start = 0;
+    size_t records = 0;                     // appended since the last checkpoint
+    uint64_t bytes = 0;                     // appended since the last checkpoint
+    uint64_t checkpoint_bytes = 0;
+    size_t compact_every;
+
+    WriteAheadLog(const std::string& log_path, size_t every) : path(log_path), compact_every(every) {}
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        if (file) std::fclose(file);
+    }
+
+    bool dirty() const { return !pending.empty(); }
+
+    // Compacting once more has been appended than the checkpoint holds keeps the cost of rewriting
+    // it proportional to what was logged.
+    bool due() const {
+        return records >= compact_every || bytes > std::max(checkpoint_bytes, MIN_LOG_COMPACT_BYTES);
+    }
+
+    // Logs the change a journaled step made when it was run forwards (done, redone) or backwards
+    // (undone). scene is the scene after the step.
+    void append(const JournalEntry& entry, bool forward, const Scene& scene) {
+        switch (entry.op) {
+        case JournalOp::Add:
+        case JournalOp::Remove: {
+            bool present = (entry.op == JournalOp::Add) == forward;
+            const Information& info = entry.op == JournalOp::Add ? entry.after : entry.before;
+            if (present) {
+                begin(LogRecord::Insert);
+                putShape(info);
+                put32(entry.below);
+                put64(entry.z_key);
+            }
+            else {
+                begin(LogRecord::Erase);
+                put32(info.id);
+            }
+            break;
+        }
+        case JournalOp::Change:
+            begin(LogRecord::Update);
+            putShape(forward ? entry.after : entry.before);
+            break;
+        case JournalOp::Resize:
+            begin(LogRecord::Resize);
+            put32(forward ? entry.width_after : entry.width_before);
+            put32(forward ? entry.height_after : entry.height_before);
+            break;
+        case JournalOp::Replace: {
+            const SceneSnapshot& snapshot = forward ? *entry.after_scene : *entry.before_scene;
+            begin(LogRecord::Replace);
+            putLayers(scene);
+            put32(snapshot.width);
+            put32(snapshot.height);
+            put64(snapshot.next_z_key);
+            put64(snapshot.shapes.size());
+            for (size_t i = 0; i < snapshot.shapes.size(); ++i) {
+                putShape(snapshot.shapes[i]);
+                put64(snapshot.keys[i]);
+            }
+            break;
+        }
+        case JournalOp::AddMany:
+            if (forward) {
+                begin(LogRecord::InsertMany);
+                put32(entry.below);
+                put64(entry.z_key);
+                put64(entry.batch.size());
+                for (const Information& info : entry.batch) putShape(info);
+            }
+            else {
+                begin(LogRecord::EraseMany);
+                put64(entry.batch.size());
+                for (auto it = entry.batch.rbegin(); it != entry.batch.rend(); ++it) put32(it->id);
+            }
+            break;
+        }
+        end();
+    }
+
+    void appendLayerNew(const std::string& name) {
+        begin(LogRecord::LayerNew);
+        putName(name);
+        end();
+    }
+
+    void appendLayerVisible(int layer, bool visible) {
+        begin(LogRecord::LayerVisible);
+        put32(layer);
+        put8(visible ? 1 : 0);
+        end();
+    }
+
+    void appendLayerMove(int layer, int position) {
+        begin(LogRecord::LayerMove);
+        put32(layer);
+        put32(position);
+        end();
+    }
+
+    // Writes everything appended since the last commit with one write and one sync. Returns false
+    // if that failed, in which case the file may end in a torn group and only a checkpoint can
+    // bring the log back.
+    bool commit() {
+        SHAPES_STAT_TIME(render_stats.log_commit);
+        bool written = file && std::fwrite(pending.data(), 1, pending.size(), file) == pending.size() && SyncFile(file);
+        pending.clear();
+        if (!written && file) {
+            std::fclose(file);
+            file = nullptr;
+        }
+        return written;
+    }
+
+    // Replaces the log with a checkpoint of the session as it is now. Pending records are dropped,
+    // since the checkpoint covers them. On failure the old log stays as it was, and nothing more is
+    // appended to it until a checkpoint succeeds.
+    bool checkpoint(const Board& board, const Scene& scene, int shape_id) {
+        SHAPES_STAT_TIME(render_stats.checkpoint);
+        if (file) std::fclose(file);
+        file = nullptr;
+        pending.clear();
+        pending.reserve(LOG_FRAME_SIZE + 64 + scene.layer_table.size() * 16 + scene.size() * (SCENE_RECORD_SIZE + 8));
+        begin(LogRecord::Checkpoint);
+        put32(shape_id);
+        putLayers(scene);
+        put32(board.width);
+        put32(board.height);
+        put64(scene.next_z_key);
+        put64(scene.size());
+        scene.forEachInOrder([&](size_t slot) {
+            putShape(scene.get(slot));
+            put64(scene.z_key[scene.ids[slot]]);
+            });
+        end();
+
+        unsigned char header[LOG_HEADER_SIZE];
+        std::memcpy(header, LOG_FILE_MAGIC, 4);
+        PutLE32(header + 4, LOG_FILE_VERSION);
+        std::string temporary = path + ".tmp";
+        std::FILE* out = std::fopen(temporary.c_str(), "wb");
+        bool written = out && std::fwrite(header, 1, sizeof(header), out) == sizeof(header) &&
+            std::fwrite(pending.data(), 1, pending.size(), out) == pending.size() && SyncFile(out);
+        if (out && std::fclose(out) != 0) written = false;
+        written = written && RenameOver(temporary, path);
+        checkpoint_bytes = pending.size();
+        pending.clear();
+        records = 0;
+        bytes = 0;
+        if (!written) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        SyncDirectoryOf(path);
+        file = std::fopen(path.c_str(), "ab");
+        return file != nullptr;
+    }
+
+private:
+    void begin(LogRecord type) {
+        record_start = pending.size();
+        pending.resize(record_start + LOG_FRAME_SIZE);
+        put8(static_cast<unsigned char>(type));
+    }
+
+    void end() {
+        unsigned char* frame = pending.data() + record_start;
+        size_t length = pending.size() - record_start - LOG_FRAME_SIZE;
+        PutLE64(frame, length);
+        PutLE32(frame + 8, Fnv1a(frame + LOG_FRAME_SIZE, length));
+        ++records;
+        bytes += LOG_FRAME_SIZE + length;
+    }
+
+    void put8(unsigned char value) {
+        pending.push_back(value);
+    }
+
+    void put32(uint32_t value) {
+        size_t at = pending.size();
+        pending.resize(at + 4);
+        PutLE32(pending.data() + at, value);
+    }
+
+    void put64(uint64_t value) {
+        size_t at = pending.size();
+        pending.resize(at + 8);
+        PutLE64(pending.data() + at, value);
+    }
+
+    void putName(const std::string& name) {
+        put8(static_cast<unsigned char>(name.size()));
+        pending.insert(pending.end(), name.begin(), name.end());
+    }
+
+    void putShape(const Information& info) {
+        size_t at = pending.size();
+        pending.resize(at + SCENE_RECORD_SIZE);
+        unsigned char* out = pending.data() + at;
+        PutLE32(out, static_cast<uint32_t>(info.id));
+        out[4] = static_cast<unsigned char>(info.type);
+        out[5] = static_cast<unsigned char>(info.outline);
+        out[6] = static_cast<unsigned char>(info.fill);
+        out[7] = info.filled ? 1 : 0;
+        PutLE32(out + 8, static_cast<uint32_t>(info.x));
+        PutLE32(out + 12, static_cast<uint32_t>(info.y));
+        PutLE32(out + 16, static_cast<uint32_t>(info.width));
+        PutLE32(out + 20, static_cast<uint32_t>(info.height));
+        PutLE32(out + 24, static_cast<uint32_t>(info.layer));
+    }
+
+    void putLayers(const Scene& scene) {
+        put32(static_cast<uint32_t>(scene.layer_table.size()));
+        for (const SceneLayer& layer : scene.layer_table) {
+            put8(layer.visible ? 1 : 0);
+            put32(layer.position);
+            putName(layer.name);
+        }
+    }
+};
+
+// Everything a command can act on. With defer_render set, as in batch mode, commands only update
+// the scene and mark the board stale; it is redrawn once, when a frame is actually printed.
+// Saves, including autosaves every autosave_every scene-changing commands, run in the background;
+// front ends call reportSaves before each prompt to print how they went. With a write-ahead log,
+// every change is logged as it is journaled, and front ends call commitLog to make it durable.
+// Once the scene has more than one layer, every layer is rasterized into its own cache and the
+// board is composited from them: a change repaints only its layer's cache, and showing, hiding or
+// reordering layers only composites again. Deferred changes mark their layer's cache dirty.
+struct Session {
+    Board board;
+    Scene scene;
+    std::unique_ptr<ThreadPool> pool;
+    BoardPrinter printer;
+    Journal journal;
+    std::vector<LayerCache> caches;     // indexed by layer id, only used while the scene is layered
+    Board view_board{ 1, 1 };           // reused by view
+    BackgroundSaver saver;
+    std::unique_ptr<WriteAheadLog> wal; // set by --wal
+    std::string autosave_file;
+    int autosave_every = 0;             // 0 turns autosave off
+    int changes_since_autosave = 0;
+    int shape_id = 1;
+    int current_layer = 0;              // where new shapes go
+    bool track_owners = false;          // keep the board's owner plane for pick
+    bool defer_render = false;
+    bool stale = false;
+    bool unprinted = false;
+
+    Session(int width, int height, int threads)
+        : board(width, height), scene(board), pool(std::make_unique<ThreadPool>(threads)) {}
+
+    // Gives every layer a cache the size of the board. New and resized caches start dirty.
+    void syncCaches() {
+        while (caches.size() < scene.layer_table.size()) {
+            caches.push_back({ Board(board.width, board.height, TRANSPARENT_CELL), true });
+        }
+        for (LayerCache& cache : caches) {
+            if (cache.board.width != board.width || cache.board.height != board.height) {
+                cache.board = Board(board.width, board.height, TRANSPARENT_CELL);
+                cache.dirty = true;
+            }
+        }
+    }
+
+    // Brings dirty caches up to date, then rebuilds area of the board from all of them.
+    void composite(const Rect& area) {
+        for (size_t layer = 0; layer < caches.size(); ++layer) {
+            if (!caches[layer].dirty) continue;
+            RedrawAll(caches[layer].board, scene, *pool, static_cast<int>(layer));
+            caches[layer].dirty = false;
+        }
+        CompositeLayers(board, scene, caches, area, *pool);
+    }
+
+    // Returns the cache of layer, ready to be repainted in place, or nullptr when the change
+    // has to wait: rendering is deferred, or the cache is dirty and will be rasterized anyway.
+    LayerCache* layerToRepaint(int layer) {
+        syncCaches();
+        LayerCache& cache = caches[layer];
+        if (defer_render) {
+            cache.dirty = true;
+            stale = true;
+            return nullptr;
+        }
+        return cache.dirty ? nullptr : &cache;
+    }
+
+    // The shape must already be in the scene.
+    void drawNew(const Information& info) {
+        unprinted = true;
+        if (scene.layered()) {
+            LayerCache* cache = layerToRepaint(info.layer);
+            if (cache) DrawShape(Canvas(cache->board), info);
+            if (!defer_render) composite(ShapeBounds(info.type, info.x, info.y, info.width));
+        }
+        else if (defer_render) stale = true;
+        else if (scene.layer_table[info.layer].visible) DrawShape(Canvas(board), info);
+    }
+
+    // The shapes at slots were just added, in that order, on top of layer; damage covers them.
+    // They are drawn in one ordered pass.
+    void drawNewBatch(const std::vector<int>& slots, int layer, const Rect& damage) {
+        unprinted = true;
+        if (scene.layered()) {
+            LayerCache* cache = layerToRepaint(layer);
+            if (cache) DrawSlots(Canvas(cache->board), scene, slots);
+            if (!defer_render) composite(damage);
+        }
+        else if (defer_render) stale = true;
+        else if (scene.layer_table[layer].visible) DrawSlots(Canvas(board), scene, slots);
+    }
+
+    void redraw(int layer, const Rect& damage) {
+        unprinted = true;
+        if (scene.layered()) {
+            LayerCache* cache = layerToRepaint(layer);
+            if (cache) RedrawRegion(cache->board, scene, damage, layer);
+            if (!defer_render) composite(damage);
+        }
+        else if (defer_render) stale = true;
+        else RedrawRegion(board, scene, damage);
+    }
+
+    void redraw(int layer, const Rect& before, const Rect& after) {
+        unprinted = true;
+        if (scene.layered()) {
+            LayerCache* cache = layerToRepaint(layer);
+            if (cache) RedrawChange(cache->board, scene, before, after, layer);
+            if (defer_render) return;
+            if (before.intersects(after)) {
+                composite(before.united(after));
+            }
+            else {
+                composite(before);
+                composite(after);
+            }
+        }
+        else if (defer_render) stale = true;
+        else RedrawChange(board, scene, before, after);
+    }
+
+    void redrawAll() {
+        unprinted = true;
+        // Boards are replaced on resize and load, and composited boards cannot say who drew a cell.
+        if (track_owners) board.trackOwners(!scene.layered());
+        if (scene.layered()) {
+            syncCaches();
+            for (LayerCache& cache : caches) cache.dirty = true;
+        }
+        if (defer_render) stale = true;
+        else if (scene.layered()) composite(board.bounds());
+        else RedrawAll(board, scene, *pool);
+    }
+
+    // The board, when its owner plane is current: it was drawn straight from a single-layer scene
+    // and is not waiting for a redraw. Otherwise nullptr.
+    const Board* ownerBoard() const {
+        return !board.owners.empty() && !stale && !scene.layered() ? &board : nullptr;
+    }
+
+    // The layer stack was shown, hidden or reordered; no layer's contents changed.
+    void recomposite() {
+        unprinted = true;
+        if (!scene.layered()) redrawAll();
+        else if (defer_render) stale = true;
+        else {
+            syncCaches();
+            composite(board.bounds());
+        }
+    }
+
+    void restore(const SceneSnapshot& snapshot) {
+        if (board.width != snapshot.width || board.height != snapshot.height) {
+            board = Board(snapshot.width, snapshot.height);
+        }
+        scene.clear();
+        scene.rebuildIndex(board);
+        scene.reserve(snapshot.shapes.size());
+        int below = -1;
+        for (size_t i = 0; i < snapshot.shapes.size(); ++i) {
+            scene.insert(snapshot.shapes[i], below, snapshot.keys[i]);
+            below = snapshot.shapes[i].id;
+        }
+        scene.next_z_key = snapshot.next_z_key;
+        redrawAll();
+    }
+
+    // Runs a journaled step backwards (undo) or forwards again (redo).
+    void apply(const JournalEntry& entry, bool forward) {
+        switch (entry.op) {
+        case JournalOp::Add:
+        case JournalOp::Remove: {
+            bool present = (entry.op == JournalOp::Add) == forward;
+            const Information& info = entry.op == JournalOp::Add ? entry.after : entry.before;
+            if (present) {
+                scene.insert(info, entry.below, entry.z_key);
+                redraw(info.layer, scene.footprint(scene.find(info.id)));
+            }
+            else {
+                int slot = scene.find(info.id);
+                Rect footprint = scene.footprint(slot);
+                scene.remove(slot);
+                redraw(info.layer, footprint);
+            }
+            break;
+        }
+        case JournalOp::Change: {
+            size_t slot = scene.find(entry.after.id);
+            Rect from = scene.footprint(slot);
+            scene.update(slot, forward ? entry.after : entry.before);
+            redraw(entry.after.layer, from, scene.footprint(slot));
+            break;
+        }
+        case JournalOp::Resize: {
+            board = forward ? Board(entry.width_after, entry.height_after) : Board(entry.width_before, entry.height_before);
+            scene.rebuildIndex(board);
+            redrawAll();
+            break;
+        }
+        case JournalOp::Replace:
+            restore(forward ? *entry.after_scene : *entry.before_scene);
+            break;
+        case JournalOp::AddMany: {
+            Rect damage = {};
+            if (forward) {
+                int below = entry.below;
+                long long key = entry.z_key;
+                for (const Information& info : entry.batch) {
+                    scene.insert(info, below, key++);
+                    below = info.id;
+                    damage = damage.united(scene.footprint(scene.find(info.id)));
+                }
+            }
+            else {
+                for (auto it = entry.batch.rbegin(); it != entry.batch.rend(); ++it) {
+                    int slot = scene.find(it->id);
+                    damage = damage.united(scene.footprint(slot));
+                    scene.remove(slot);
+                }
+            }
+            redraw(entry.batch.front().layer, damage);
+            break;
+        }
+        }
+    }
+
+    void undo() {
+        if (journal.done.empty()) {
+            std::cout << "Nothing to undo\n";
+            return;
+        }
+        JournalEntry entry = std::move(journal.done.back());
+        journal.done.pop_back();
+        apply(entry, false);
+        if (wal) wal->append(entry, false, scene);
+        journal.undone.push_back(std::move(entry));
+    }
+
+    void redo() {
+        if (journal.undone.empty()) {
+            std::cout << "Nothing to redo\n";
+            return;
+        }
+        JournalEntry entry = std::move(journal.undone.back());
+        journal.undone.pop_back();
+        apply(entry, true);
+        if (wal) wal->append(entry, true, scene);
+        journal.done.push_back(std::move(entry));
+    }
+
+    // Journals a step that was just run, logging it too when there is a log.
+    void record(JournalEntry entry) {
+        if (wal) wal->append(entry, true, scene);
+        journal.record(std::move(entry));
+    }
+
+    // Writes and syncs the changes logged since the last call, then compacts the log if it is due.
+    // A log that could not be written is replaced by a checkpoint of the session.
+    void commitLog() {
+        if (!wal || !wal->dirty()) return;
+        if (wal->commit() && !wal->due()) return;
+        if (!wal->checkpoint(board, scene, shape_id)) std::cerr << "Could not write the log " << wal->path << "\n";
+    }
+
+    void countChange() {
+        if (autosave_every <= 0 || ++changes_since_autosave < autosave_every) return;
+        changes_since_autosave = 0;
+        saver.save(autosave_file, board.width, board.height, scene, true);
+    }
+
+    void reportSaves() {
+        std::vector<std::string> messages;
+        if (!saver.takeOutcomes(messages)) return;
+        for (const std::string& message : messages) std::cout << message << "\n";
+    }
+
+    // Waits for outstanding saves, then reports them.
+    void finishSaves() {
+        saver.flush();
+        reportSaves();
+    }
+
+    void print() {
+        if (stale) {
+            if (scene.layered()) {
+                syncCaches();
+                composite(board.bounds());
+            }
+            else {
+                RedrawAll(board, scene, *pool);
+            }
+            stale = false;
+        }
+        printer.print(board);
+        unprinted = false;
+    }
+};
+
+// Reads the fields of one log record. Reading past its end yields zeros and clears ok.
+struct LogReader {
+    const unsigned char* p;
+    const unsigned char* end;
+    bool ok = true;
+    bool glyph_colors = false;      // version 1 logs store colours as glyphs
+
+    size_t remaining() const { return static_cast<size_t>(end - p); }
+
+    // Whether the record was read to its end and no further.
+    bool done() const { return ok && p == end; }
+
+    bool take(size_t count) {
+        if (remaining() < count) {
+            ok = false;
+            p = end;
+        }
+        return ok;
+    }
+
+    unsigned char u8() {
+        return take(1) ? *p++ : 0;
+    }
+
+    uint32_t u32() {
+        if (!take(4)) return 0;
+        p += 4;
+        return GetLE32(p - 4);
+    }
+
+    uint64_t u64() {
+        if (!take(8)) return 0;
+        p += 8;
+        return GetLE64(p - 8);
+    }
+
+    std::string name() {
+        size_t length = u8();
+        if (!take(length)) return std::string();
+        p += length;
+        return std::string(reinterpret_cast<const char*>(p - length), length);
+    }
+
+    Information shape() {
+        Information info;
+        if (!take(SCENE_RECORD_SIZE)) return info;
+        info = Information(static_cast<int>(GetLE32(p)), static_cast<ShapeKind>(p[4]),
+            static_cast<int>(GetLE32(p + 8)), static_cast<int>(GetLE32(p + 12)),
+            static_cast<int>(GetLE32(p + 16)), static_cast<int>(GetLE32(p + 20)),
+            static_cast<char>(p[5]), static_cast<char>(p[6]), p[7] != 0);
+        if (glyph_colors) {
+            info.outline = palette.from_glyph[p[5]];
+            info.fill = palette.from_glyph[p[6]];
+        }
+        info.layer = static_cast<int>(GetLE32(p + 24));
+        p += SCENE_RECORD_SIZE;
+        return info;
+    }
+};
+
+// Accepts what the scene loaders do, since a loaded scene is logged as it is.
+bool ValidLoggedShape(const Scene& scene, const Information& info) {
+    return info.id >= 0 && info.id <= MAX_SHAPE_ID && static_cast<int>(info.type) < SHAPE_KIND_COUNT &&
+        ValidShapeGeometry(info) && info.layer >= 0 && info.layer < static_cast<int>(scene.layer_table.size());
+}
+
+// Brings the scene's layer table to the one in the record. Layers are never deleted, so the
+// table the scene has must be a prefix of it.
+bool ReadLoggedLayers(LogReader& in, Scene& scene) {
+    uint32_t count = in.u32();
+    if (!in.ok || count < scene.layer_table.size() || count > in.remaining()) return false;
+    std::vector<int> order(count, -1);
+    for (uint32_t layer = 0; layer < count; ++layer) {
+        bool visible = in.u8() != 0;
+        uint32_t position = in.u32();
+        std::string name = in.name();
+        if (!in.ok || position >= count || order[position] >= 0 || !ValidLayerName(name)) return false;
+        if (layer < scene.layer_table.size()) {
+            if (scene.layer_table[layer].name != name) return false;
+        }
+        else {
+            scene.addLayer(name);
+        }
+        scene.layer_table[layer].visible = visible;
+        order[position] = static_cast<int>(layer);
+    }
+    for (uint32_t position = 0; position < count; ++position) {
+        scene.moveLayer(order[position], static_cast<int>(position));
+    }
+    return true;
+}
+
+bool ReadLoggedScene(LogReader& in, const Scene& scene, SceneSnapshot& snapshot, int& next_id) {
+    snapshot.width = static_cast<int>(in.u32());
+    snapshot.height = static_cast<int>(in.u32());
+    snapshot.next_z_key = static_cast<long long>(in.u64());
+    uint64_t count = in.u64();
+    if (!in.ok || !ValidBoardSize(snapshot.width, snapshot.height) || count > in.remaining() / (SCENE_RECORD_SIZE + 8)) return false;
+    snapshot.shapes.reserve(static_cast<size_t>(count));
+    snapshot.keys.reserve(static_cast<size_t>(count));
+    for (uint64_t i = 0; i < count; ++i) {
+        snapshot.shapes.push_back(in.shape());
+        snapshot.keys.push_back(static_cast<long long>(in.u64()));
+        if (!ValidLoggedShape(scene, snapshot.shapes.back())) return false;
+        next_id = std::max(next_id, snapshot.shapes.back().id + 1);
+    }
+    std::vector<int> ids(snapshot.shapes.size());
+    for (size_t i = 0; i < ids.size(); ++i) ids[i] = snapshot.shapes[i].id;
+    std::sort(ids.begin(), ids.end());
+    return in.done() && std::adjacent_find(ids.begin(), ids.end()) == ids.end();
+}
+
+// Runs one record against the session. Returns false if it is malformed or does not fit the scene
+// as replayed so far, which only a bug or a damaged disk can cause.
+bool ReplayRecord(Session& session, LogReader& in, int& next_id) {
+    Scene& scene = session.scene;
+    JournalEntry entry;
+    LogRecord type = static_cast<LogRecord>(in.u8());
+    switch (type) {
+    case LogRecord::Checkpoint:
+    case LogRecord::Replace: {
+        if (type == LogRecord::Checkpoint) next_id = std::max(next_id, static_cast<int>(std::min<uint32_t>(in.u32(), MAX_SHAPE_ID + 1)));
+        SceneSnapshot snapshot;
+        if (!ReadLoggedLayers(in, scene) || !ReadLoggedScene(in, scene, snapshot, next_id)) return false;
+        session.restore(snapshot);
+        return true;
+    }
+    case LogRecord::Insert:
+        entry.op = JournalOp::Add;
+        entry.after = in.shape();
+        entry.below = static_cast<int>(in.u32());
+        entry.z_key = static_cast<long long>(in.u64());
+        if (!in.done() || !ValidLoggedShape(scene, entry.after) || scene.find(entry.after.id) >= 0 ||
+            (entry.below >= 0 && scene.find(entry.below) < 0)) return false;
+        next_id = std::max(next_id, entry.after.id + 1);
+        break;
+    case LogRecord::Erase: {
+        int slot = scene.find(static_cast<int>(in.u32()));
+        if (!in.done() || slot < 0) return false;
+        entry.op = JournalOp::Remove;
+        entry.before = scene.get(slot);
+        break;
+    }
+    case LogRecord::Update:
+        entry.op = JournalOp::Change;
+        entry.after = in.shape();
+        entry.before = entry.after;
+        if (!in.done() || !ValidLoggedShape(scene, entry.after) || scene.find(entry.after.id) < 0) return false;
+        break;
+    case LogRecord::Resize:
+        entry.op = JournalOp::Resize;
+        entry.width_after = static_cast<int>(in.u32());
+        entry.height_after = static_cast<int>(in.u32());
+        if (!in.done() || !ValidBoardSize(entry.width_after, entry.height_after)) return false;
+        break;
+    case LogRecord::InsertMany: {
+        entry.op = JournalOp::AddMany;
+        entry.below = static_cast<int>(in.u32());
+        entry.z_key = static_cast<long long>(in.u64());
+        uint64_t count = in.u64();
+        if (!in.ok || count == 0 || count > in.remaining() / SCENE_RECORD_SIZE) return false;
+        if (entry.below >= 0 && scene.find(entry.below) < 0) return false;
+        entry.batch.reserve(static_cast<size_t>(count));
+        for (uint64_t i = 0; i < count; ++i) {
+            entry.batch.push_back(in.shape());
+            const Information& info = entry.batch.back();
+            if (!ValidLoggedShape(scene, info) || scene.find(info.id) >= 0) return false;
+            next_id = std::max(next_id, info.id + 1);
+        }
+        if (!in.done()) return false;
+        break;
+    }
+    case LogRecord::EraseMany: {
+        uint64_t count = in.u64();
+        if (!in.ok || count == 0 || count > in.remaining() / 4) return false;
+        Rect damage = {};
+        int layer = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            int slot = scene.find(static_cast<int>(in.u32()));
+            if (slot < 0) return false;
+            layer = scene.layers[slot];
+            damage = damage.united(scene.footprint(slot));
+            scene.remove(slot);
+        }
+        session.redraw(layer, damage);
+        return in.done();
+    }
+    case LogRecord::LayerNew: {
+        std::string name = in.name();
+        if (!in.done() || !ValidLayerName(name) || scene.findLayer(name) >= 0) return false;
+        scene.addLayer(name);
+        return true;
+    }
+    case LogRecord::LayerVisible: {
+        uint32_t layer = in.u32();
+        bool visible = in.u8() != 0;
+        if (!in.done() || layer >= scene.layer_table.size()) return false;
+        scene.layer_table[layer].visible = visible;
+        session.recomposite();
+        return true;
+    }
+    case LogRecord::LayerMove: {
+        uint32_t layer = in.u32();
+        uint32_t position = in.u32();
+        if (!in.done() || layer >= scene.layer_table.size() || position >= scene.layer_order.size()) return false;
+        scene.moveLayer(static_cast<int>(layer), static_cast<int>(position));
+        session.recomposite();
+        return true;
+    }
+    default:
+        return false;
+    }
+    session.apply(entry, true);
+    return true;
+}
+
+// Rebuilds the session from the log at path: the checkpoint it starts with, then every record
+// after it. Stops at the first record that is cut short or fails its checksum, which is where a
+// crash interrupted a commit, and sets torn. The history starts out empty. Returns false, with
+// the session untouched, if the file is not a log, and also when a record does not fit the
+// scene: the records after it are still on disk, so the caller must not write over the log.
+bool ReplayLog(Session& session, const std::string& path, size_t& replayed, bool& torn) {
+    MappedFile mapped;
+    if (!mapped.open(path)) {
+        std::cerr << "Could not open the log " << path << "\n";
+        return false;
+    }
+    const unsigned char* data = mapped.data;
+    const unsigned char* end = data + mapped.size;
+    if (mapped.size < LOG_HEADER_SIZE + LOG_FRAME_SIZE + 1 || std::memcmp(data, LOG_FILE_MAGIC, 4) != 0 ||
+        GetLE32(data + 4) < 1 || GetLE32(data + 4) > LOG_FILE_VERSION || data[LOG_HEADER_SIZE + LOG_FRAME_SIZE] != static_cast<unsigned char>(LogRecord::Checkpoint)) {
+        std::cerr << path << " is not a log this version can replay\n";
+        return false;
+    }
+
+    bool deferred = session.defer_render;
+    session.defer_render = true;
+    int next_id = 1;
+    replayed = 0;
+    torn = false;
+    bool complete = true;
+    const unsigned char* p = data + LOG_HEADER_SIZE;
+    while (p < end) {
+        size_t available = static_cast<size_t>(end - p);
+        if (available < LOG_FRAME_SIZE || GetLE64(p) == 0 || GetLE64(p) > available - LOG_FRAME_SIZE ||
+            Fnv1a(p + LOG_FRAME_SIZE, static_cast<size_t>(GetLE64(p))) != GetLE32(p + 8)) {
+            torn = true;
+            break;
+        }
+        LogReader in = { p + LOG_FRAME_SIZE, p + LOG_FRAME_SIZE + GetLE64(p) };
+        in.glyph_colors = GetLE32(data + 4) == 1;
+        if (!ReplayRecord(session, in, next_id)) {
+            std::cerr << path << ": record at byte " << p - data << " does not fit the scene, replay stopped there\n";
+            complete = false;
+            break;
+        }
+        if (p != data + LOG_HEADER_SIZE) ++replayed;
+        p = in.end;
+    }
+    session.shape_id = next_id;
+    session.current_layer = 0;
+    session.defer_render = deferred;
+    session.stale = false;
+    session.redrawAll();
+    return complete;
+}
+
+// --wal: recovers the session from the log if there is one, then starts the log afresh with a
+// checkpoint of the session, which also drops a torn tail. Returns false if the log cannot be used.
+bool OpenLog(Session& session, const std::string& path, size_t compact_every) {
+    if (std::FILE* existing = std::fopen(path.c_str(), "rb")) {
+        std::fclose(existing);
+        auto start = std::chrono::steady_clock::now();
+        size_t replayed = 0;
+        bool torn = false;
+        if (!ReplayLog(session, path, replayed, torn)) {
+            std::cerr << "The log " << path << " was left as it is; move it aside to start without it\n";
+            return false;
+        }
+        std::cerr << "Recovered " << session.scene.size() << (session.scene.size() == 1 ? " shape" : " shapes")
+            << " from " << path << ", a checkpoint and " << replayed << (replayed == 1 ? " change" : " changes")
+            << " in " << ElapsedNs(start) / 1000000 << " ms\n";
+        if (torn) std::cerr << "The log ended in an incomplete record, which was dropped\n";
+    }
+    session.wal = std::make_unique<WriteAheadLog>(path, compact_every);
+    if (!session.wal->checkpoint(session.board, session.scene, session.shape_id)) {
+        std::cerr << "Could not write the log " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+Information ShapeFromCommand(int id, ShapeKind kind, const Command& command) {
+    return kind == ShapeKind::Line
+        ? Information(id, kind, command.x, command.y, command.size, 0, Color(command.outline))
+        : Information(id, kind, command.x, command.y, command.size, 0, Color(command.outline), Color(command.fill), command.on);
+}
+
+void AddShape(Session& session, ShapeKind kind, const Command& command) {
+    Information info = ShapeFromCommand(session.shape_id, kind, command);
+    info.layer = session.current_layer;
+    if (PlaceShape(session.board, info, session.scene)) {
+        JournalEntry entry;
+        entry.op = JournalOp::Add;
+        entry.after = info;
+        entry.below = session.scene.z_tail;
+        entry.z_key = session.scene.next_z_key;
+
+        session.scene.add(info);
+        session.drawNew(info);
+        session.record(std::move(entry));
+        ++session.shape_id;
+    }
+}
+
+// Adds every shape described in the file, one shape command per line in the batch syntax
+// (e.g. "circle 10 10 5 red blue yes"), to the current layer as a single undoable step. Shapes
+// are accepted or rejected exactly as if they had been added one at a time; rejections are
+// counted, and the first few reported with their line numbers.
+void ImportShapes(Session& session, const std::string& filename) {
+    const int MAX_REPORTED = 10;
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Could not open the file " << filename << "\n";
+        return;
+    }
+
+    std::vector<Information> shapes;
+    std::vector<long long> line_numbers;
+    LineReader reader(file);
+    const char* begin;
+    const char* end;
+    bool too_long;
+    while (reader.next(begin, end, too_long)) {
+        const char* first = SkipBlanks(begin, end);
+        if (first == end || *first == '#') continue;
+
+        Command command;
+        const char* error = "line too long";
+        bool parsed = !too_long && ParseCommand(first, end, command, error);
+        ShapeKind kind = ShapeKind::Circle;
+        switch (command.kind) {
+        case CommandKind::Triangle: kind = ShapeKind::Triangle; break;
+        case CommandKind::Circle: kind = ShapeKind::Circle; break;
+        case CommandKind::Square: kind = ShapeKind::Square; break;
+        case CommandKind::Line: kind = ShapeKind::Line; break;
+        default:
+            if (parsed) error = "not a shape";
+            parsed = false;
+            break;
+        }
+        if (!parsed) {
+            std::cerr << filename << ":" << reader.line_number << ": " << error << "\n";
+            continue;
+        }
+        Information info = ShapeFromCommand(0, kind, command);
+        info.layer = session.current_layer;
+        shapes.push_back(info);
+        line_numbers.push_back(reader.line_number);
+    }
+    std::fclose(file);
+
+    Scene& scene = session.scene;
+    JournalEntry entry;
+    entry.op = JournalOp::AddMany;
+    entry.below = scene.z_tail;
+    entry.z_key = scene.next_z_key;
+    int first_id = session.shape_id;
+    std::vector<PlaceResult> results;
+    std::vector<int> slots;
+    size_t accepted = InsertShapes(session.board, scene, shapes, session.shape_id, results, slots);
+
+    int reported = 0;
+    for (size_t i = 0; i < shapes.size() && reported < MAX_REPORTED; ++i) {
+        if (results[i] == PlaceResult::Placed) continue;
+        std::cout << filename << ":" << line_numbers[i] << ": " << PlaceResultMessage(results[i]) << "\n";
+        ++reported;
+    }
+    std::cout << "Imported " << accepted << (accepted == 1 ? " shape" : " shapes");
+    if (accepted > 0) std::cout << " (IDs " << first_id << " to " << session.shape_id - 1 << ")";
+    std::cout << ", rejected " << shapes.size() - accepted << "\n";
+    if (accepted == 0) return;
+
+    entry.batch.reserve(accepted);
+    Rect damage = {};
+    for (int slot : slots) {
+        entry.batch.push_back(scene.get(slot));
+        damage = damage.united(scene.footprint(slot));
+    }
+    session.drawNewBatch(slots, session.current_layer, damage);
+    session.record(std::move(entry));
+}
+
+void RemoveShape(Session& session, int id) {
+    Scene& scene = session.scene;
+    int index = scene.find(id);
+    if (index >= 0) {
+        JournalEntry entry;
+        entry.op = JournalOp::Remove;
+        entry.before = scene.get(index);
+        entry.below = scene.z_prev[id];
+        entry.z_key = scene.z_key[id];
+
+        Rect before = scene.footprint(index);
+        scene.remove(index);
+
+        session.redraw(entry.before.layer, before);
+        session.record(std::move(entry));
+        std::cout << "Shape removed.\n";
+    }
+    else {
+        std::cout << "No shape with ID " << id << " found.\n";
+    }
+}
+
+void PaintShape(Session& session, const Command& command) {
+    char new_outline_color = Color(command.outline);
+    char new_fill_color = Color(command.fill);
+
+    Scene& scene = session.scene;
+    int index = scene.find(command.id);
+    if (index >= 0) {
+        JournalEntry entry;
+        entry.before = scene.get(index);
+        scene.outlines[index] = new_outline_color;
+        scene.fills[index] = new_fill_color;
+        entry.after = scene.get(index);
+
+        session.redraw(entry.after.layer, scene.footprint(index));
+        if (!SameShape(entry.before, entry.after)) session.record(std::move(entry));
+    }
+    else {
+        std::cout << "Shape with ID " << command.id << " not found.\n";
+    }
+}
+
+// The read-only commands write to out rather than straight to the console, so the scene server
+// can run them on its own threads.
+void ListShapes(const Scene& scene, std::ostream& out) {
+    scene.forEachInOrder([&](size_t slot) {
+        Information info = scene.get(slot);
+        if (info.type == ShapeKind::Circle) {
+            out << "> " << info.id << " " << KindName(info.type) << " radius: " << info.width << "\n";
+            out << "coordinates: (" << info.x << ", " << info.y << ")\n";
+        }
+        else if (info.type == ShapeKind::Square) {
+            out << "> " << info.id << " " << KindName(info.type) << " width: " << info.width << " height: " << info.height << "\n";
+            out << "coordinates: (" << info.x << ", " << info.y << ")\n";
+        }
+        else if (info.type == ShapeKind::Triangle) {
+            out << "> " << info.id << " " << KindName(info.type) << " height: " << info.width << "\n";
+            out << "coordinates: (" << info.x << ", " << info.y << ")\n";
+        }
+        });
+}
+
+void SelectShape(const Scene& scene, int id, std::ostream& out) {
+    int index = scene.find(id);
+    if (index >= 0) {
+        Information info = scene.get(index);
+        out << KindName(info.type) << " " << info.x << " " << info.y << " " << info.width << " ";
+        if (info.type != ShapeKind::Circle) {
+            out << info.height << " ";
+        }
+        out << "Outline Color: " << ColorLabel(info.outline) << ", Fill Color: " << ColorLabel(info.fill);
+    }
+    else {
+        out << "Could not find this figure";
+    }
+}
+
+// The part of bounds that x, y, width, height covers, or an empty rect after reporting why.
+Rect BoardArea(const Rect& bounds, const Command& command, std::ostream& out) {
+    if (command.width <= 0 || command.height <= 0) {
+        out << "The area must have a positive width and height\n";
+        return {};
+    }
+    Rect area = Rect{ command.x, command.y, command.x + command.width, command.y + command.height }.intersected(bounds);
+    if (area.empty()) {
+        out << "The area is outside the board\n";
+    }
+    return area;
+}
+
+// Renders the part of the scene that the command's area covers into view, resizing it to fit.
+// Returns false, after reporting why, when the area misses the board.
+bool RenderCommandView(Board& view, const Scene& scene, const Rect& bounds, const Command& command, std::ostream& out) {
+    Rect area = BoardArea(bounds, command, out);
+    if (area.empty()) return false;
+
+    if (view.width != area.x1 - area.x0 || view.height != area.y1 - area.y0) {
+        view = Board(area.x1 - area.x0, area.y1 - area.y0);
+    }
+    RenderView(view, scene, area);
+    return true;
+}
+
+// Prints the part of the board inside the area, clipped to the board, rendered from just the
+// shapes that reach into it. The board itself is neither redrawn nor read.
+void ViewBoard(Session& session, const Command& command) {
+    if (RenderCommandView(session.view_board, session.scene, session.board.bounds(), command, std::cout)) {
+        session.printer.print(session.view_board);
+    }
+}
+
+// Lists, bottom to top, the ids of the shapes whose bounding box intersects the area, hidden
+// layers included. Only the index buckets under the area are visited.
+void QueryShapes(const Scene& scene, const Rect& bounds, const Command& command, std::ostream& out) {
+    Rect area = BoardArea(bounds, command, out);
+    if (area.empty()) return;
+
+    static thread_local std::vector<int> found;
+    scene.shapesIn(area, found);
+    for (int& id : found) id = scene.find(id);
+    scene.sortByLayer(-1, found);
+
+    out << found.size() << (found.size() == 1 ? " shape" : " shapes");
+    for (int slot : found) out << " " << scene.ids[slot];
+    out << "\n";
+}
+
+// pick x y [all]: the shape painted on top at cell (x, y), described as select does, or with all
+// the ids of every shape painted there, topmost first. Shapes on hidden layers are skipped. The
+// index narrows the search to the shapes around the cell and the rasterizers' geometry settles
+// which of them paint it. owners, a board with a current owner plane, answers the topmost case
+// with a single lookup.
+void PickShapes(const Scene& scene, const Rect& bounds, const Board* owners, const Command& command, std::ostream& out) {
+    if (command.x < bounds.x0 || command.x >= bounds.x1 || command.y < bounds.y0 || command.y >= bounds.y1) {
+        out << "(" << command.x << ", " << command.y << ") is not on the board\n";
+        return;
+    }
+
+    int top = NO_OWNER;
+    static thread_local std::vector<int> found;
+    if (owners && !command.on) {
+        top = owners->ownerAt(command.x, command.y);
+    }
+    else {
+        scene.shapesAt(command.x, command.y, command.on, found);
+        if (command.on) {
+            out << found.size() << (found.size() == 1 ? " shape" : " shapes");
+            for (int slot : found) out << " " << scene.ids[slot];
+            out << "\n";
+            return;
+        }
+        if (!found.empty()) top = scene.ids[found[0]];
+    }
+
+    if (top == NO_OWNER) {
+        out << "No shape at (" << command.x << ", " << command.y << ")\n";
+        return;
+    }
+    out << top << " ";
+    SelectShape(scene, top, out);
+    out << "\n";
+}
+
+void SetOwners(Session& session, bool on) {
+    session.track_owners = on;
+    session.board.trackOwners(on);
+    if (on) session.redrawAll();
+}
+
+void ResizeBoard(Session& session, int width, int height) {
+    if (ValidBoardSize(width, height)) {
+        // Built before the entry is recorded, so a resize that cannot allocate is never logged.
+        Board board(width, height);
+
+        JournalEntry entry;
+        entry.op = JournalOp::Resize;
+        entry.width_before = session.board.width;
+        entry.height_before = session.board.height;
+        entry.width_after = width;
+        entry.height_after = height;
+        session.record(std::move(entry));
+
+        session.board = std::move(board);
+        session.scene.rebuildIndex(session.board);
+        session.redrawAll();
+    }
+    else {
+        std::cout << "Board size must be from 1 to " << MAX_BOARD_SIDE << " on each side\n";
+    }
+}
+
+void EditShape(Session& session, const Command& command) {
+    const Board& board = session.board;
+    Scene& scene = session.scene;
+
+    int found = scene.find(command.id);
+    if (found < 0) {
+        std::cout << "This shape was not found";
+        return;
+    }
+
+    size_t index = found;
+    Information info = scene.get(index);
+    Rect before = scene.footprint(index);
+
+    switch (command.property) {
+    case 2: {
+        int updatedX = command.value;
+        if (updatedX >= 0 && updatedX <= MAX_BOARD_SIDE && updatedX + info.width < board.width && (info.type != ShapeKind::Circle || info.height == 0)) {
+            info.x = updatedX;
+        }
+        else {
+            std::cout << "Wrong coordinate\n";
+        }
+        break;
+    }
+    case 3: {
+        int updatedY = command.value;
+        if (updatedY >= 0 && updatedY <= MAX_BOARD_SIDE && updatedY + info.height < board.height) {
+            info.y = updatedY;
+        }
+        else {
+            std::cout << "Wrong coordinate\n";
+        }
+        break;
+    }
+    case 4: {
+        int updatedDim = command.value;
+        if (updatedDim > 0 && updatedDim <= MAX_BOARD_SIDE) {
+            info.width = updatedDim;
+        }
+        else {
+            std::cout << "Wrong height\n";
+        }
+        break;
+    }
+    case 5: {
+        if (info.type != ShapeKind::Circle) {
+            int updatedHeight = command.value;
+            if (updatedHeight > 0 && updatedHeight <= MAX_BOARD_SIDE) {
+                info.height = updatedHeight;
+            }
+            else {
+                std::cout << "Invalid Height\n";
+            }
+        }
+        else {
+            std::cout << "Circles don't have height\n";
+        }
+        break;
+    }
+    case 6: {
+        char newOutlineCharColor = Color(command.text);
+        if (newOutlineCharColor != UNKNOWN_COLOR) {
+            info.outline = newOutlineCharColor;
+        }
+        else {
+            std::cout << "Unsupported outline color\n";
+        }
+        break;
+    }
+    case 7: {
+        char newFillCharColor = Color(command.text);
+        if (newFillCharColor != UNKNOWN_COLOR) {
+            info.fill = newFillCharColor;
+        }
+        else {
+            std::cout << "You cannot use this fill color\n";
+        }
+        break;
+    }
+    default:
+        std::cout << "You did not choose a correct property\n";
+        return;
+    }
+
+    JournalEntry entry;
+    entry.before = scene.get(index);
+    entry.after = info;
+    scene.update(index, info);
+    session.redraw(info.layer, before, scene.footprint(index));
+    if (!SameShape(entry.before, entry.after)) session.record(std::move(entry));
+
+    std::cout << "This shape was updated\n";
+}
+
+void MoveShape(Session& session, const Command& command) {
+    const Board& board = session.board;
+    Scene& scene = session.scene;
+    int id = command.id;
+
+    int found = scene.find(id);
+    if (found < 0) {
+        std::cout << "This shape was not found \n";
+        return;
+    }
+
+    size_t index = found;
+    Information info = scene.get(index);
+
+    if (!ShapeFits(board, info.type, command.x, command.y, info.width)) {
+        std::cout << "You cannot place this shape outside of the board \n";
+        return;
+    }
+
+    if (scene.anchorTaken(command.x, command.y, id)) {
+        std::cout << "Another shape is already placed here \n";
+        return;
+    }
+
+    Rect after = ShapeBounds(info.type, command.x, command.y, info.width);
+    if (scene.reject_overlap && !after.empty() && scene.overlaps(after, id)) {
+        std::cout << "The shape would overlap another shape \n";
+        return;
+    }
+
+    Rect before = scene.footprint(index);
+    JournalEntry entry;
+    entry.before = info;
+    info.x = command.x;
+    info.y = command.y;
+    entry.after = info;
+
+    scene.update(index, info);
+    session.redraw(info.layer, before, after);
+    if (!SameShape(entry.before, entry.after)) session.record(std::move(entry));
+}
+
+void ListLayers(const Session& session) {
+    const Scene& scene = session.scene;
+    std::vector<size_t> counts(scene.layer_table.size(), 0);
+    for (size_t i = 0; i < scene.size(); ++i) ++counts[scene.layers[i]];
+    for (int position = static_cast<int>(scene.layer_order.size()) - 1; position >= 0; --position) {
+        int layer = scene.layer_order[position];
+        std::cout << position << " " << scene.layer_table[layer].name << ": " << counts[layer] << " shapes"
+            << (scene.layer_table[layer].visible ? "" : ", hidden") << (layer == session.current_layer ? ", current" : "") << "\n";
+    }
+}
+
+// layer new|use|hide|show|move|list: new stacks an empty layer on top and makes it current,
+// use picks the layer new shapes go to, move puts a layer at a position counted from the bottom.
+void ChangeLayer(Session& session, const Command& command) {
+    Scene& scene = session.scene;
+    if (command.text == "list") {
+        ListLayers(session);
+        return;
+    }
+
+    int layer = scene.findLayer(command.name);
+    if (command.text == "new") {
+        if (layer >= 0) {
+            std::cout << "A layer named " << command.name << " already exists\n";
+        }
+        else if (!ValidLayerName(command.name)) {
+            std::cout << "Layer names are single words of at most " << MAX_LAYER_NAME << " characters\n";
+        }
+        else {
+            session.current_layer = scene.addLayer(command.name);
+            if (session.wal) session.wal->appendLayerNew(command.name);
+        }
+        return;
+    }
+    if (layer < 0) {
+        std::cout << "No layer named " << command.name << "\n";
+        return;
+    }
+
+    if (command.text == "use") {
+        session.current_layer = layer;
+    }
+    else if (command.text == "hide" || command.text == "show") {
+        bool visible = command.text == "show";
+        if (scene.layer_table[layer].visible == visible) return;
+        scene.layer_table[layer].visible = visible;
+        if (session.wal) session.wal->appendLayerVisible(layer, visible);
+        session.recomposite();
+    }
+    else if (command.text == "move") {
+        if (command.value < 0 || command.value >= static_cast<int>(scene.layer_order.size())) {
+            std::cout << "Layer positions go from 0 to " << scene.layer_order.size() - 1 << "\n";
+            return;
+        }
+        if (scene.layer_table[layer].position == command.value) return;
+        scene.moveLayer(layer, command.value);
+        if (session.wal) session.wal->appendLayerMove(layer, command.value);
+        session.recomposite();
+    }
+    else {
+        std::cout << "Unknown layer action " << command.text << "\n";
+    }
+}
+
+// allocations < 0 leaves the allocations column empty.
+void WriteLatencyRow(std::ostream& out, const char* name, const LatencyHistogram& histogram, double allocations = -1) {
+    if (histogram.count() == 0) return;
+    char row[160];
+    int length = std::snprintf(row, sizeof(row), "%-14s %10llu %12.1f %12.1f %12.1f", name,
+        static_cast<unsigned long long>(histogram.count()), histogram.percentile(0.5) / 1000.0,
+        histogram.percentile(0.99) / 1000.0, histogram.max_ns.load(std::memory_order_relaxed) / 1000.0);
+    if (allocations >= 0) {
+        std::snprintf(row + length, sizeof(row) - length, " %12.2f", allocations / histogram.count());
+    }
+    out << row << "\n";
+}
+
+// Everything the instrumentation has collected so far, as a plain-text table.
+void WriteStats(std::ostream& out) {
+#ifdef SHAPES_STATS
+    out << "latency (us)        count          p50          p99          max    allocs/op\n";
+    for (int kind = 0; kind < COMMAND_KIND_COUNT; ++kind) {
+        WriteLatencyRow(out, COMMAND_NAMES[kind].name, command_latency[kind], static_cast<double>(command_allocations[kind]));
+    }
+    WriteLatencyRow(out, "[full redraw]", render_stats.full_redraw);
+    WriteLatencyRow(out, "[region redraw]", render_stats.region_redraw);
+    WriteLatencyRow(out, "[composite]", render_stats.composite);
+    WriteLatencyRow(out, "[save]", render_stats.save);
+    WriteLatencyRow(out, "[load]", render_stats.load);
+    WriteLatencyRow(out, "[snapshot]", render_stats.snapshot);
+    WriteLatencyRow(out, "[log commit]", render_stats.log_commit);
+    WriteLatencyRow(out, "[checkpoint]", render_stats.checkpoint);
+
+    out << "rasterized       shapes        cells  cells/shape\n";
+    for (int kind = 0; kind < SHAPE_KIND_COUNT; ++kind) {
+        uint64_t shapes = render_stats.shapes_drawn[kind].load(std::memory_order_relaxed);
+        uint64_t cells = render_stats.kind_cells[kind].load(std::memory_order_relaxed);
+        char row[96];
+        std::snprintf(row, sizeof(row), "%-10s %12llu %12llu %12.1f\n", KindName(static_cast<ShapeKind>(kind)),
+            static_cast<unsigned long long>(shapes), static_cast<unsigned long long>(cells),
+            shapes ? static_cast<double>(cells) / shapes : 0.0);
+        out << row;
+    }
+    out << "cells written: " << render_stats.cells_written.load(std::memory_order_relaxed) << "\n";
+    out << "full redraws: " << render_stats.full_redraw.count()
+        << ", region redraws: " << render_stats.region_redraw.count() << "\n";
+    uint64_t allocations = allocation_counters.allocations.load(std::memory_order_relaxed);
+    uint64_t frees = allocation_counters.frees.load(std::memory_order_relaxed);
+    out << "allocations: " << allocations << ", frees: " << frees << ", live: " << allocations - frees
+        << ", bytes requested: " << allocation_counters.bytes.load(std::memory_order_relaxed) << "\n";
+#else
+    out << "Statistics are compiled out (SHAPES_NO_STATS)\n";
+#endif
+}
+
+bool ChangesScene(const Command& command) {
+    switch (command.kind) {
+    case CommandKind::Triangle:
+    case CommandKind::Circle:
+    case CommandKind::Square:
+    case CommandKind::Line:
+    case CommandKind::Remove:
+    case CommandKind::Paint:
+    case CommandKind::Load:
+    case CommandKind::Clear:
+    case CommandKind::Undo:
+    case CommandKind::Redo:
+    case CommandKind::Resize:
+    case CommandKind::Edit:
+    case CommandKind::Move:
+    case CommandKind::Import:
+        return true;
+    case CommandKind::Layer:
+        return command.text != "list";
+    default:
+        return false;
+    }
+}
+
+void SetAutosave(Session& session, const Command& command) {
+    if (command.value < 0) {
+        std::cout << "The autosave interval cannot be negative\n";
+        return;
+    }
+    session.autosave_every = command.value;
+    session.autosave_file = command.text;
+    session.changes_since_autosave = 0;
+    if (command.value == 0) std::cout << "Autosave is off\n";
+    else std::cout << "Autosaving to " << command.text << " every " << command.value << (command.value == 1 ? " change" : " changes") << "\n";
+}
+
+// Runs one command against the session. Returns false when the command asks to stop.
+bool Execute(Session& session, const Command& command) {
+    SHAPES_STAT_TIME(command_latency[static_cast<int>(command.kind)]);
+    SHAPES_STAT_SCOPE(ScopedAllocationCount, command_allocations[static_cast<int>(command.kind)]);
+    switch (command.kind) {
+    case CommandKind::Draw:
+        session.print();
+        break;
+    case CommandKind::Triangle:
+        AddShape(session, ShapeKind::Triangle, command);
+        break;
+    case CommandKind::Circle:
+        AddShape(session, ShapeKind::Circle, command);
+        break;
+    case CommandKind::Square:
+        AddShape(session, ShapeKind::Square, command);
+        break;
+    case CommandKind::Line:
+        AddShape(session, ShapeKind::Line, command);
+        break;
+    case CommandKind::Remove:
+        RemoveShape(session, command.id);
+        break;
+    case CommandKind::Paint:
+        PaintShape(session, command);
+        break;
+    case CommandKind::Save:
+        session.saver.save(command.text, session.board.width, session.board.height, session.scene, false);
+        break;
+    case CommandKind::Import:
+        session.saver.flush();
+        ImportShapes(session, command.text);
+        break;
+    case CommandKind::Autosave:
+        SetAutosave(session, command);
+        break;
+    case CommandKind::Load: {
+        // A save still being written may be the file about to be read.
+        session.saver.flush();
+        JournalEntry entry;
+        entry.op = JournalOp::Replace;
+        entry.before_scene = std::make_unique<SceneSnapshot>(session.board, session.scene);
+        if (loadFromFile(command.text, session.board, session.scene, session.shape_id)) {
+            entry.after_scene = std::make_unique<SceneSnapshot>(session.board, session.scene);
+            session.record(std::move(entry));
+            session.redrawAll();
+        }
+        break;
+    }
+    case CommandKind::Clear: {
+        JournalEntry entry;
+        entry.op = JournalOp::Replace;
+        entry.before_scene = std::make_unique<SceneSnapshot>(session.board, session.scene);
+        session.board.release();
+        session.scene.clear();
+        for (LayerCache& cache : session.caches) cache.board.release();
+        entry.after_scene = std::make_unique<SceneSnapshot>(session.board, session.scene);
+        session.record(std::move(entry));
+        session.stale = false;
+        session.unprinted = true;
+        break;
+    }
+    case CommandKind::Exit:
+        return false;
+    case CommandKind::Undo:
+        session.undo();
+        break;
+    case CommandKind::Redo:
+        session.redo();
+        break;
+    case CommandKind::History:
+        if (command.value > 0) {
+            session.journal.setLimit(static_cast<size_t>(command.value) * 1024);
+        }
+        else {
+            std::cout << "History size must be positive\n";
+        }
+        break;
+    case CommandKind::List:
+        ListShapes(session.scene, std::cout);
+        break;
+    case CommandKind::Stats:
+        std::cout << "board " << session.board.width << "x" << session.board.height << ", "
+            << (session.board.tiled ? "tiled" : "dense") << ", " << session.board.bytes() / 1024 << " KiB of cells";
+        if (!session.board.owners.empty()) std::cout << ", " << session.board.owners.size() * sizeof(int) / 1024 << " KiB of owners";
+        std::cout << "\n";
+        WriteStats(std::cout);
+        break;
+    case CommandKind::Shapes:
+        std::cout << "circle coordinates radius\n";
+        std::cout << "square coordinates side size\n";
+        std::cout << "triangle coordinates height\n";
+        break;
+    case CommandKind::Select:
+        SelectShape(session.scene, command.id, std::cout);
+        break;
+    case CommandKind::Resize:
+        ResizeBoard(session, command.width, command.height);
+        break;
+    case CommandKind::Threads:
+        if (ValidThreadCount(command.value)) {
+            session.pool = std::make_unique<ThreadPool>(command.value);
+        }
+        else {
+            std::cout << "Thread count must be from 1 to " << MaxRenderThreads() << "\n";
+        }
+        break;
+    case CommandKind::Ansi:
+        session.printer.setAnsi(command.on);
+        break;
+    case CommandKind::Overlap:
+        session.scene.reject_overlap = command.on;
+        break;
+    case CommandKind::Edit:
+        EditShape(session, command);
+        break;
+    case CommandKind::Move:
+        MoveShape(session, command);
+        break;
+    case CommandKind::Layer:
+        ChangeLayer(session, command);
+        break;
+    case CommandKind::View:
+        ViewBoard(session, command);
+        break;
+    case CommandKind::Query:
+        QueryShapes(session.scene, session.board.bounds(), command, std::cout);
+        break;
+    case CommandKind::Pick:
+        PickShapes(session.scene, session.board.bounds(), session.ownerBoard(), command, std::cout);
+        break;
+    case CommandKind::Owners:
+        SetOwners(session, command.on);
+        break;
+    }
+    if (ChangesScene(command)) session.countChange();
+    return true;
+}
+
+void PromptEditArguments(const Session& session, Command& command) {
+    std::cout << "Enter the ID of the shape you want to edit: ";
+    std::cin >> command.id;
+
+    int found = session.scene.find(command.id);
+    if (found < 0) return;
+
+    Information info = session.scene.get(found);
+    std::cout << "1. Type of the figure: " << KindName(info.type) << "\n";
+    std::cout << "2. X coordinate: " << info.x << "\n";
+    std::cout << "3. Y coordinate: " << info.y << "\n";
+    std::cout << "4. Width of a figure " << info.width << "\n";
+    if (info.type != ShapeKind::Circle) {
+        std::cout << "5. Height of the figure: " << info.height << "\n";
+    }
+    std::cout << "6. Outline of the figure: " << ColorLabel(info.outline) << "\n";
+    std::cout << "7. Fill of the figure: " << ColorLabel(info.fill) << "\n";
+
+    std::cout << "Which property do you want to edit? ";
+    std::cin >> command.property;
+
+    switch (command.property) {
+    case 2:
+        std::cout << "Enter new X coordinate for a figure: ";
+        std::cin >> command.value;
+        break;
+    case 3:
+        std::cout << "Enter new Y coordinate for a figure: ";
+        std::cin >> command.value;
+        break;
+    case 4:
+        std::cout << "Enter new width of a figure: ";
+        std::cin >> command.value;
+        break;
+    case 5:
+        if (info.type != ShapeKind::Circle) {
+            std::cout << "Enter new height of a figure ";
+            std::cin >> command.value;
+        }
+        break;
+    case 6:
+        std::cout << "Enter a new outline color (a name such as red or orange, or #rrggbb): ";
+        std::cin >> command.text;
+        break;
+    case 7:
+        std::cout << "Enter a new fill color (a name such as red or orange, or #rrggbb): ";
+        std::cin >> command.text;
+        break;
+    }
+}
+
+// Interactive front end: asks for the arguments of the command with the given kind on stdin.
+void PromptArguments(const Session& session, Command& command) {
+    std::string fillInput;
+    switch (command.kind) {
+    case CommandKind::Triangle:
+        std::cout << "Enter the location of the triangle, its height, outline color, fill color, and if it should be filled (yes or no): ";
+        std::cin >> command.x >> command.y >> command.size >> command.outline >> command.fill >> fillInput;
+        command.on = (fillInput == "yes");
+        break;
+    case CommandKind::Circle:
+        std::cout << "Enter the location of the circle, its radius, outline color, fill color, and if it should be filled (yes or no): ";
+        std::cin >> command.x >> command.y >> command.size >> command.outline >> command.fill >> fillInput;
+        command.on = (fillInput == "yes");
+        break;
+    case CommandKind::Square:
+        std::cout << "Enter the location of the square, its side length, outline color, fill color, and if it should be filled (yes or no): ";
+        std::cin >> command.x >> command.y >> command.size >> command.outline >> command.fill >> fillInput;
+        command.on = (fillInput == "yes");
+        break;
+    case CommandKind::Line:
+        std::cout << "Enter the location of the line, its length, and its color: ";
+        std::cin >> command.x >> command.y >> command.size >> command.outline;
+        break;
+    case CommandKind::Remove:
+        std::cout << "Enter the ID of the shape to remove: ";
+        std::cin >> command.id;
+        break;
+    case CommandKind::Paint:
+        std::cout << "Enter shape's ID, outline color, and fill color: ";
+        std::cin >> command.id >> command.outline >> command.fill;
+        break;
+    case CommandKind::Save:
+    case CommandKind::Load:
+    case CommandKind::Import:
+        std::cout << "Enter the filename: ";
+        std::cin >> command.text;
+        break;
+    case CommandKind::Autosave:
+        std::cout << "Enter how many changes to make between autosaves (0 turns autosave off): ";
+        std::cin >> command.value;
+        if (command.value > 0) {
+            std::cout << "Enter the filename: ";
+            std::cin >> command.text;
+        }
+        break;
+    case CommandKind::Select:
+        std::cout << "Enter ID of the figure you want to check: ";
+        std::cin >> command.id;
+        break;
+    case CommandKind::Resize:
+        std::cout << "Enter new width and height of the board: ";
+        std::cin >> command.width >> command.height;
+        break;
+    case CommandKind::Threads:
+        std::cout << "Enter the number of render threads: ";
+        std::cin >> command.value;
+        break;
+    case CommandKind::History:
+        std::cout << "Enter the memory for undo history in KiB: ";
+        std::cin >> command.value;
+        break;
+    case CommandKind::Ansi:
+        std::cout << "Only redraw changed rows with ANSI escapes (on or off): ";
+        std::cin >> command.text;
+        command.on = (command.text == "on");
+        break;
+    case CommandKind::Overlap:
+        std::cout << "Reject overlapping shapes (on or off): ";
+        std::cin >> command.text;
+        command.on = (command.text == "on");
+        break;
+    case CommandKind::Owners:
+        std::cout << "Keep a per-cell owner buffer for pick (on or off): ";
+        std::cin >> command.text;
+        command.on = (command.text == "on");
+        break;
+    case CommandKind::Pick:
+        std::cout << "Enter the coordinates of the cell: ";
+        std::cin >> command.x >> command.y;
+        std::cout << "List every shape there rather than the top one (yes or no): ";
+        std::cin >> command.text;
+        command.on = (command.text == "yes");
+        break;
+    case CommandKind::Edit:
+        PromptEditArguments(session, command);
+        break;
+    case CommandKind::Move:
+        std::cout << "Enter the ID of the shape you want to move: ";
+        std::cin >> command.id;
+        if (session.scene.find(command.id) >= 0) {
+            std::cout << "Enter new coordinates for the shape: ";
+            std::cin >> command.x >> command.y;
+        }
+        break;
+    case CommandKind::View:
+    case CommandKind::Query:
+        std::cout << "Enter the top-left corner, width and height of the area: ";
+        std::cin >> command.x >> command.y >> command.width >> command.height;
+        break;
+    case CommandKind::Layer:
+        std::cout << "Enter a layer action (new, use, hide, show, move, list): ";
+        std::cin >> command.text;
+        if (command.text != "list") {
+            std::cout << "Enter the name of the layer: ";
+            std::cin >> command.name;
+        }
+        if (command.text == "move") {
+            std::cout << "Enter its new position (0 is the bottom): ";
+            std::cin >> command.value;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void RunInteractive(Session& session) {
+    std::string word;
+    while (true) {
+        session.reportSaves();
+        std::cout << "Enter a shape (circle, square, triangle, line), 'clear', or 'exit': ";
+        if (!(std::cin >> word)) break;
+
+        Command command;
+        if (!CommandFromName(word, command.kind)) continue;
+        PromptArguments(session, command);
+        bool running = Execute(session, command);
+        session.commitLog();
+        if (!running) break;
+    }
+    session.finishSaves();
+}
+
+// Batch front end: one command per line in the same order the prompts ask for arguments,
+// e.g. "circle 10 10 5 red blue yes" or "edit 3 6 green". Blank lines and lines starting
+// with '#' are skipped. Returns false with a reason for a line that does not parse.
+bool ParseCommand(const char* begin, const char* end, Command& command, const char*& error) {
+    std::string_view tokens[8];
+    int count = 0;
+    const char* p = SkipBlanks(begin, end);
+    while (p < end) {
+        const char* start = p;
+        while (p < end && !IsBlank(*p)) ++p;
+        if (count == 8) {
+            error = "too many arguments";
+            return false;
+        }
+        tokens[count++] = std::string_view(start, p - start);
+        p = SkipBlanks(p, end);
+    }
+
+    command = Command();
+    if (!CommandFromName(tokens[0], command.kind)) {
+        error = "unknown command";
+        return false;
+    }
+
+    // Properties 2 to 5 of edit take a number and 6 and 7 a colour; the others take nothing.
+    int edit_property = 0;
+    if (command.kind == CommandKind::Edit && count > 2) std::from_chars(tokens[2].data(), tokens[2].data() + tokens[2].size(), edit_property);
+
+    int expected = 0;
+    switch (command.kind) {
+    case CommandKind::Triangle:
+    case CommandKind::Circle:
+    case CommandKind::Square: expected = 6; break;
+    case CommandKind::Line: expected = 4; break;
+    case CommandKind::Remove:
+    case CommandKind::Select:
+    case CommandKind::Save:
+    case CommandKind::Load:
+    case CommandKind::Import:
+    case CommandKind::Threads:
+    case CommandKind::History:
+    case CommandKind::Ansi:
+    case CommandKind::Overlap:
+    case CommandKind::Owners: expected = 1; break;
+    case CommandKind::Resize: expected = 2; break;
+    case CommandKind::Paint:
+    case CommandKind::Move: expected = 3; break;
+    case CommandKind::Edit: expected = edit_property >= 2 && edit_property <= 7 ? 3 : 2; break;
+    case CommandKind::Layer: expected = tokens[1] == "list" ? 1 : tokens[1] == "move" ? 3 : 2; break;
+    case CommandKind::View:
+    case CommandKind::Query: expected = 4; break;
+    case CommandKind::Autosave: expected = tokens[1] == "0" ? 1 : 2; break;
+    case CommandKind::Pick: expected = count == 4 ? 3 : 2; break;
+    default: break;
+    }
+    if (count - 1 != expected) {
+        error = "wrong number of arguments";
+        return false;
+    }
+
+    bool numbers_ok = true;
+    auto number = [&](int token, int& value) {
+        std::string_view text = tokens[token];
+        std::from_chars_result result = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size()) numbers_ok = false;
+    };
+
+    switch (command.kind) {
+    case CommandKind::Triangle:
+    case CommandKind::Circle:
+    case CommandKind::Square:
+        number(1, command.x);
+        number(2, command.y);
+        number(3, command.size);
+        command.outline = tokens[4];
+        command.fill = tokens[5];
+        command.on = tokens[6] == "yes";
+        break;
+    case CommandKind::Line:
+        number(1, command.x);
+        number(2, command.y);
+        number(3, command.size);
+        command.outline = tokens[4];
+        break;
+    case CommandKind::Remove:
+    case CommandKind::Select:
+        number(1, command.id);
+        break;
+    case CommandKind::Paint:
+        number(1, command.id);
+        command.outline = tokens[2];
+        command.fill = tokens[3];
+        break;
+    case CommandKind::Save:
+    case CommandKind::Load:
+    case CommandKind::Import:
+        command.text = tokens[1];
+        break;
+    case CommandKind::Resize:
+        number(1, command.width);
+        number(2, command.height);
+        break;
+    case CommandKind::Threads:
+    case CommandKind::History:
+        number(1, command.value);
+        break;
+    case CommandKind::Autosave:
+        number(1, command.value);
+        if (count > 2) command.text = tokens[2];
+        break;
+    case CommandKind::Ansi:
+    case CommandKind::Overlap:
+    case CommandKind::Owners:
+        command.on = tokens[1] == "on";
+        break;
+    case CommandKind::Pick:
+        number(1, command.x);
+        number(2, command.y);
+        if (count == 4 && tokens[3] != "all") {
+            error = "expected all";
+            return false;
+        }
+        command.on = count == 4;
+        break;
+    case CommandKind::Edit:
+        number(1, command.id);
+        number(2, command.property);
+        if (command.property == 6 || command.property == 7) command.text = tokens[3];
+        else if (command.property >= 2 && command.property <= 5) number(3, command.value);
+        break;
+    case CommandKind::Move:
+        number(1, command.id);
+        number(2, command.x);
+        number(3, command.y);
+        break;
+    case CommandKind::View:
+    case CommandKind::Query:
+        number(1, command.x);
+        number(2, command.y);
+        number(3, command.width);
+        number(4, command.height);
+        break;
+    case CommandKind::Layer:
+        command.text = tokens[1];
+        if (count > 2) command.name = tokens[2];
+        if (count > 3) number(3, command.value);
+        break;
+    default:
+        break;
+    }
+    if (!numbers_ok) {
+        error = "expected a number";
+        return false;
+    }
+    return true;
+}
+
+// Reads the script a block of lines at a time: the block is parsed into commands first and
+// only then executed, so parsing never interleaves with scene updates. No prompts are printed
+// and rendering is deferred to explicit draws; if the scene changed after the last draw, the
+// final board is printed when the script ends.
+int RunBatch(Session& session, const std::string& script) {
+    std::FILE* file = script == "-" ? stdin : std::fopen(script.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Could not open the script " << script << "\n";
+        return 1;
+    }
+
+    const size_t block_size = 4096;
+    std::vector<Command> block;
+    block.reserve(block_size);
+    session.defer_render = true;
+
+    LineReader reader(file);
+    bool running = true;
+    bool more = true;
+    while (running && more) {
+        block.clear();
+        const char* begin;
+        const char* end;
+        bool too_long;
+        while (block.size() < block_size && (more = reader.next(begin, end, too_long))) {
+            const char* first = SkipBlanks(begin, end);
+            if (first == end || *first == '#') continue;
+
+            Command command;
+            const char* error = "line too long";
+            if (too_long || !ParseCommand(first, end, command, error)) {
+                std::cerr << script << ":" << reader.line_number << ": " << error << "\n";
+                continue;
+            }
+            block.push_back(std::move(command));
+        }
+
+        for (const Command& command : block) {
+            if (!Execute(session, command)) {
+                running = false;
+                break;
+            }
+            session.reportSaves();
+        }
+        session.commitLog();
+    }
+
+    if (file != stdin) std::fclose(file);
+    if (session.unprinted) session.print();
+    session.finishSaves();
+    return 0;
+}
+
+#ifndef _WIN32
+// Scene server (--serve). One process owns the session and answers any number of clients on a
+// Unix domain socket. Clients send commands one per line in the batch syntax; every line gets
+// one reply, "ok <bytes>\n" followed by that many bytes of output, or "error <reason>\n" for a
+// line that does not parse. exit closes the connection.
+//
+// Writes go through a single writer thread. It applies everything that queued up while it was
+// busy, then publishes one immutable copy of the scene for the whole batch. Reads (list, select,
+// shapes, draw, view, query, pick) run on the client's own thread against whichever copy is
+// current, so they never wait for a write and a long render never holds one up. A client's reply
+// to a write is sent after the copy holding that write is published, so its next read sees it,
+// and with --wal after the batch is synced to the log, so an acknowledged write survives a crash.
+// Copies are reference counted, and a reader keeps the one it started with alive. A copy shares
+// the session scene's chunks copy-on-write, so publishing takes constant time and each write
+// after it copies only the chunks it touches. Spent copies are dropped, not kept for reuse, since
+// a kept copy would pin those chunks and make the writer copy them again.
+
+// The scene as of one writer batch. Never changed while published.
+struct PublishedScene {
+    int width = 0;
+    int height = 0;
+    uint64_t version = 0;
+    Scene scene{ Board(1, 1) };   // assigned whole from the session's scene
+};
+
+struct QueuedWrite {
+    const Command* command = nullptr;
+    std::string output;
+    bool done = false;
+};
+
+struct SceneServer {
+    Session& session;
+    std::shared_ptr<const PublishedScene> current;        // only touched through std::atomic_load/exchange
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::condition_variable writes_done;
+    std::vector<QueuedWrite*> queue;
+    bool stopping = false;
+    std::thread writer;
+
+    explicit SceneServer(Session& target) : session(target) {
+        // Writes only touch the scene; readers render from the published copies.
+        session.defer_render = true;
+        publish();
+        writer = std::thread([this] { runWriter(); });
+    }
+
+    ~SceneServer() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_one();
+        writer.join();
+    }
+
+    std::shared_ptr<const PublishedScene> snapshot() const {
+        return std::atomic_load(&current);
+    }
+
+    // Runs a write on the writer thread and returns what it printed.
+    std::string write(const Command& command) {
+        QueuedWrite entry;
+        entry.command = &command;
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue.push_back(&entry);
+        queue_ready.notify_one();
+        writes_done.wait(lock, [&] { return entry.done; });
+        return std::move(entry.output);
+    }
+
+private:
+    void runWriter() {
+        std::vector<QueuedWrite*> batch;
+        std::ostringstream capture;
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        while (true) {
+            queue_ready.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            batch.swap(queue);
+            lock.unlock();
+
+            // Only this thread writes to the console streams while the server runs.
+            std::streambuf* console_out = std::cout.rdbuf(capture.rdbuf());
+            std::streambuf* console_err = std::cerr.rdbuf(capture.rdbuf());
+            for (QueuedWrite* entry : batch) {
+                Execute(session, *entry->command);
+                session.reportSaves();
+                entry->output = capture.str();
+                capture.str("");
+            }
+            std::cout.rdbuf(console_out);
+            std::cerr.rdbuf(console_err);
+            session.commitLog();
+            publish();
+
+            lock.lock();
+            for (QueuedWrite* entry : batch) entry->done = true;
+            batch.clear();
+            writes_done.notify_all();
+        }
+    }
+
+    void publish() {
+        auto next = std::make_shared<PublishedScene>();
+        std::shared_ptr<const PublishedScene> previous = std::atomic_load(&current);
+        next->width = session.board.width;
+        next->height = session.board.height;
+        next->version = previous ? previous->version + 1 : 1;
+        next->scene.assign(session.scene);
+        previous.reset();
+
+        std::atomic_store(&current, std::shared_ptr<const PublishedScene>(std::move(next)));
+    }
+};
+
+bool ServedFromSnapshot(CommandKind kind) {
+    switch (kind) {
+    case CommandKind::Draw:
+    case CommandKind::List:
+    case CommandKind::Shapes:
+    case CommandKind::Select:
+    case CommandKind::View:
+    case CommandKind::Query:
+    case CommandKind::Pick:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void AppendBoardRows(const Board& board, std::string& out) {
+    size_t used = out.size();
+    out.resize(used + static_cast<size_t>(board.width + 1) * board.height);
+    char* row = &out[used];
+    for (int y = 0; y < board.height; ++y) {
+        board.readRow(y, 0, board.width, row);
+        ToGlyphs(row, board.width);
+        row[board.width] = '\n';
+        row += board.width + 1;
+    }
+}
+
+// Answers a read from a published scene. frame is the connection's own render target.
+void ReadPublished(const PublishedScene& published, const Command& command, Board& frame, std::string& output) {
+    SHAPES_STAT_TIME(command_latency[static_cast<int>(command.kind)]);
+    const Scene& scene = published.scene;
+    Rect bounds = { 0, 0, published.width, published.height };
+    std::ostringstream out;
+    switch (command.kind) {
+    case CommandKind::Draw:
+        if (frame.width != published.width || frame.height != published.height) {
+            frame = Board(published.width, published.height);
+        }
+        RedrawAllSerial(frame, scene);
+        AppendBoardRows(frame, output);
+        return;
+    case CommandKind::View:
+        if (RenderCommandView(frame, scene, bounds, command, out)) {
+            AppendBoardRows(frame, output);
+            return;
+        }
+        break;
+    case CommandKind::List:
+        ListShapes(scene, out);
+        break;
+    case CommandKind::Shapes:
+        out << "circle coordinates radius\n";
+        out << "square coordinates side size\n";
+        out << "triangle coordinates height\n";
+        break;
+    case CommandKind::Select:
+        SelectShape(scene, command.id, out);
+        break;
+    case CommandKind::Query:
+        QueryShapes(scene, bounds, command, out);
+        break;
+    case CommandKind::Pick:
+        PickShapes(scene, bounds, nullptr, command, out);
+        break;
+    default:
+        break;
+    }
+    output += out.str();
+}
+
+bool SendAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Runs one client connection until it says exit, hangs up, or the server stops.
+void ServeClient(SceneServer& server, int fd) {
+    const size_t MAX_LINE = 64 * 1024;
+    std::string pending;
+    std::string output;
+    std::string reply;
+    Board frame(1, 1);
+    char buffer[4096];
+
+    bool open = true;
+    while (open) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        pending.append(buffer, static_cast<size_t>(received));
+
+        size_t start = 0;
+        size_t newline;
+        while (open && (newline = pending.find('\n', start)) != std::string::npos) {
+            const char* begin = pending.data() + start;
+            const char* end = pending.data() + newline;
+            start = newline + 1;
+            if (end > begin && end[-1] == '\r') --end;
+            const char* first = SkipBlanks(begin, end);
+            if (first == end || *first == '#') continue;
+
+            Command command;
+            const char* error;
+            reply.clear();
+            if (!ParseCommand(first, end, command, error)) {
+                reply = "error ";
+                reply += error;
+                reply += "\n";
+            }
+            else if (command.kind == CommandKind::Exit) {
+                open = false;
+                break;
+            }
+            else {
+                output.clear();
+                if (ServedFromSnapshot(command.kind)) ReadPublished(*server.snapshot(), command, frame, output);
+                else output = server.write(command);
+                reply = "ok " + std::to_string(output.size()) + "\n";
+                reply += output;
             }
+            if (!SendAll(fd, reply.data(), reply.size())) open = false;
         }
-
-        for (int j = 0; j < 2 * height - 1; ++j) {
-            int baseX = x - height + 1 + j;
-            int baseY = y + height - 1;
-            if (baseX >= 0 && baseX < BOARD_WIDTH && baseY < BOARD_HEIGHT)
-                board.grid[baseY][baseX] = outline;
+        pending.erase(0, start);
+        if (pending.size() > MAX_LINE) {
+            const char too_long[] = "error line too long\n";
+            SendAll(fd, too_long, sizeof(too_long) - 1);
+            open = false;
         }
     }
+}
+
+volatile std::sig_atomic_t server_stop_requested = 0;
+
+extern "C" void RequestServerStop(int) {
+    server_stop_requested = 1;
+}
 
-    bool Fits(int x, int y) override {
-        return x - height >= 0 && x + height < BOARD_WIDTH && y >= 0 && y + height < BOARD_HEIGHT;
+int OpenServerSocket(const std::string& path) {
+    sockaddr_un address = {};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path is too long: " << path << "\n";
+        return -1;
     }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
 
-    bool Duplicate(const Information& info) override {
-        return info.type == "triangle" && info.width == height;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "Could not create a socket: " << std::strerror(errno) << "\n";
+        return -1;
     }
-};
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "Could not listen on " << path << ": " << std::strerror(errno) << "\n";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-struct Line : public Shape {
-    int length;
+// --serve: serves the session on a Unix domain socket until SIGINT or SIGTERM. Every client
+// gets its own thread; on the way out their connections are shut down and joined.
+int RunServer(Session& session, const std::string& path) {
+    int listener = OpenServerSocket(path);
+    if (listener < 0) return 1;
 
-    Line(int len) : length(len) {}
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT, RequestServerStop);
+    std::signal(SIGTERM, RequestServerStop);
 
-    void draw(Board& board, int X, int Y, char outline, char fill, bool fillInside = false) override {
-        if (length <= 0) return;
+    std::mutex clients_mutex;
+    std::condition_variable client_left;
+    std::vector<int> clients;
+    {
+        SceneServer server(session);
+        std::cerr << "Serving on " << path << "\n";
+        while (!server_stop_requested) {
+            pollfd waiting = { listener, POLLIN, 0 };
+            if (poll(&waiting, 1, 200) <= 0) continue;
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
 
-        for (int x = 0; x < length; ++x) {
-            int drawnX = X + x;
-            if (drawnX >= 0 && drawnX < BOARD_WIDTH && Y >= 0 && Y < BOARD_HEIGHT) {
-                board.grid[Y][drawnX] = outline;
-            }
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            clients.push_back(fd);
+            std::thread([&, fd] {
+                ServeClient(server, fd);
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                clients.erase(std::find(clients.begin(), clients.end(), fd));
+                close(fd);
+                client_left.notify_all();
+                }).detach();
         }
-    }
 
-    bool Fits(int x, int y) override {
-        return x >= 0 && x + length < BOARD_WIDTH && y >= 0 && y < BOARD_HEIGHT;
+        std::unique_lock<std::mutex> lock(clients_mutex);
+        for (int fd : clients) shutdown(fd, SHUT_RDWR);
+        client_left.wait(lock, [&] { return clients.empty(); });
     }
+    close(listener);
+    unlink(path.c_str());
+    return 0;
+}
 
-    bool Duplicate(const Information& info) override {
-        return info.type == "line" && info.width == length;
+int ConnectToServer(const std::string& path) {
+    sockaddr_un address = {};
+    if (path.size() >= sizeof(address.sun_path)) return -1;
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
     }
-};
+    return fd;
+}
 
-bool PlaceShape(int x, int y, Shape* shape, const std::vector<Information>& shapes_info, const std::string& type, int dim1, int dim2 = 0) {
-    if (!shape->Fits(x, y)) {
-        std::cout << "Shape doesn't fit on the board.\n";
-        return false;
+// Client side of one request: sends line and reads its whole reply into reply.
+bool RoundTrip(int fd, const std::string& line, std::string& pending, std::string& reply) {
+    if (!SendAll(fd, line.data(), line.size())) return false;
+    char buffer[65536];
+    size_t header_end;
+    while ((header_end = pending.find('\n')) == std::string::npos) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+        pending.append(buffer, static_cast<size_t>(received));
     }
-
-    for (const auto& info : shapes_info) {
-        if (info.x == x && info.y == y && info.type == type && info.width == dim1 && info.height == dim2) {
-            std::cout << "Shape with the same type and parameters already exists at this location.\n";
-            return false;
-        }
+    size_t length = 0;
+    if (pending.compare(0, 3, "ok ") == 0) length = std::strtoull(pending.c_str() + 3, nullptr, 10);
+    size_t total = header_end + 1 + length;
+    while (pending.size() < total) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) return false;
+        pending.append(buffer, static_cast<size_t>(received));
     }
+    reply.assign(pending, 0, total);
+    pending.erase(0, total);
     return true;
 }
 
-void saveToFile(const std::string& filename, const std::vector<Information>& shapes_info) {
-    std::ofstream file(filename);
-    if (!file) {
-        std::cerr << "Could not save the file";
-        return;
-    }
+// --loadgen: drives a running server from several client threads with a seeded mix of writes
+// (add, move, paint) and reads (view, query, select, and an occasional full draw), then reports
+// throughput and latency per side. The board size given on the command line should match the
+// server's, so that generated shapes land on the board.
+int RunLoadGenerator(const std::string& path, int clients, int operations, int write_percent, int width, int height) {
+    std::signal(SIGPIPE, SIG_IGN);
+    LatencyHistogram reads;
+    LatencyHistogram writes;
+    std::atomic<int> added{ 0 };
+    std::atomic<int> failed{ 0 };
+    const char* colors[] = { "red", "green", "blue" };
 
-    for (const auto& info : shapes_info) {
-        file << info.id << " " << info.type << " " << info.x << " " << info.y << " "
-            << info.width << " " << info.height << " "
-            << info.outline << " " << info.fill << "\n";
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int client = 0; client < clients; ++client) {
+        threads.emplace_back([&, client] {
+            int fd = ConnectToServer(path);
+            if (fd < 0) {
+                ++failed;
+                return;
+            }
+            std::mt19937 rng(12345 + client);
+            std::string line, pending, reply;
+            for (int op = 0; op < operations; ++op) {
+                bool is_write = static_cast<int>(rng() % 100) < write_percent;
+                int x = rng() % width;
+                int y = rng() % height;
+                int known = std::max(1, added.load(std::memory_order_relaxed));
+                int id = 1 + rng() % known;
+                char text[96];
+                if (is_write) {
+                    switch (rng() % 3) {
+                    case 0:
+                        std::snprintf(text, sizeof(text), "circle %d %d %d %s %s yes\n", x, y, 1 + static_cast<int>(rng() % 4),
+                            colors[rng() % 3], colors[rng() % 3]);
+                        added.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                    case 1:
+                        std::snprintf(text, sizeof(text), "move %d %d %d\n", id, x, y);
+                        break;
+                    default:
+                        std::snprintf(text, sizeof(text), "paint %d %s %s\n", id, colors[rng() % 3], colors[rng() % 3]);
+                        break;
+                    }
+                }
+                else {
+                    switch (rng() % 16) {
+                    case 0:
+                        std::snprintf(text, sizeof(text), "draw\n");
+                        break;
+                    case 1: case 2: case 3: case 4:
+                        std::snprintf(text, sizeof(text), "select %d\n", id);
+                        break;
+                    case 5: case 6: case 7: case 8: case 9:
+                        std::snprintf(text, sizeof(text), "query %d %d 16 16\n", x, y);
+                        break;
+                    default:
+                        std::snprintf(text, sizeof(text), "view %d %d 32 16\n", x, y);
+                        break;
+                    }
+                }
+                line = text;
+                auto sent = std::chrono::steady_clock::now();
+                if (!RoundTrip(fd, line, pending, reply)) {
+                    ++failed;
+                    break;
+                }
+                (is_write ? writes : reads).record(ElapsedNs(sent));
+            }
+            close(fd);
+            });
     }
+    for (std::thread& thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    file.close();
+    uint64_t total = reads.count() + writes.count();
+    std::printf("%d clients, %llu requests in %.2f s, %.0f requests/s\n", clients,
+        static_cast<unsigned long long>(total), seconds, seconds > 0 ? total / seconds : 0.0);
+    std::cout << "latency (us)        count          p50          p99          max\n";
+    WriteLatencyRow(std::cout, "read", reads);
+    WriteLatencyRow(std::cout, "write", writes);
+    if (failed) std::cout << failed << " clients lost their connection\n";
+    return failed ? 1 : 0;
 }
+#endif
 
-void loadFromFile(const std::string& filename, Board& board, std::vector<Shape*>& shapes, std::vector<Information>& shapes_info, int& shape_id) {
-    std::ifstream file(filename);
-    if (!file) {
-        std::cerr << "Could not open the file";
-        return;
-    }
+// Synthetic scenes for --bench. Every generator is seeded, so a run is reproducible.
+enum class BenchScene {
+    Uniform,        // mixed kinds and small sizes spread over the whole board
+    Clustered,      // the same mix packed around a few hot spots
+    Overlap,        // larger shapes piled on the central eighth of the board
+    LargeRadius     // few circles with radii of a quarter of the board
+};
 
-    shapes_info.clear();
-    for (auto& shape : shapes) {
-        delete shape;
+const char* BenchSceneName(BenchScene scene) {
+    switch (scene) {
+    case BenchScene::Uniform: return "uniform";
+    case BenchScene::Clustered: return "clustered";
+    case BenchScene::Overlap: return "overlap";
+    case BenchScene::LargeRadius: return "large_radius";
     }
-    shapes.clear();
-    board.clear();
+    return "";
+}
+
+std::vector<Information> GenerateScene(BenchScene scene, const Board& board, uint32_t seed) {
+    std::mt19937 rng(seed);
+    long long area = static_cast<long long>(board.width) * board.height;
+    size_t count = static_cast<size_t>(std::min<long long>(std::max<long long>(area / 256, 64), 1 << 20));
+    if (scene == BenchScene::LargeRadius) count = std::max<size_t>(count / 256, 8);
+
+    int max_dim = std::min(board.width, board.height);
+    std::vector<Information> shapes;
+    shapes.reserve(count);
 
-    int id, x, y, dim1, dim2;
-    char outline, fill;
-    std::string type;
+    std::vector<std::pair<int, int>> centers;
+    for (int i = 0; i < 16; ++i) {
+        centers.push_back({ static_cast<int>(rng() % board.width), static_cast<int>(rng() % board.height) });
+    }
+    std::normal_distribution<double> spread(0.0, max_dim / 32.0 + 1.0);
+    const char colors[] = { Color("red"), Color("green"), Color("blue") };
 
-    while (file >> id >> type >> x >> y >> dim1 >> dim2 >> outline >> fill) {
-        if (type == "circle") {
-            Circle* circle = new Circle(dim1);
-            circle->draw(board, x, y, outline, fill, true);
-            shapes.push_back(circle);
-            shapes_info.emplace_back(id, type, x, y, dim1, dim2, outline, fill);
+    int attempts = 0;
+    while (shapes.size() < count && attempts++ < static_cast<int>(count) * 20) {
+        ShapeKind kind = static_cast<ShapeKind>(rng() % 4);
+        int x, y, dim;
+        switch (scene) {
+        case BenchScene::Uniform:
+            x = rng() % board.width;
+            y = rng() % board.height;
+            dim = 1 + rng() % 16;
+            break;
+        case BenchScene::Clustered: {
+            const std::pair<int, int>& center = centers[rng() % centers.size()];
+            x = center.first + static_cast<int>(spread(rng));
+            y = center.second + static_cast<int>(spread(rng));
+            dim = 1 + rng() % 16;
+            break;
+        }
+        case BenchScene::Overlap:
+            x = board.width / 2 - board.width / 16 + rng() % (board.width / 8 + 1);
+            y = board.height / 2 - board.height / 16 + rng() % (board.height / 8 + 1);
+            dim = 4 + rng() % 29;
+            break;
+        default:
+            kind = ShapeKind::Circle;
+            dim = std::max(1, max_dim / 8 + static_cast<int>(rng() % (max_dim / 8 + 1)));
+            x = dim + rng() % std::max(1, board.width - 2 * dim);
+            y = rng() % board.height;
+            break;
         }
-        else if (type == "square") {
-            Square* square = new Square(dim1);
-            square->draw(board, x, y, outline, fill, true);
-            shapes.push_back(square);
-            shapes_info.emplace_back(id, type, x, y, dim1, dim2, outline, fill);
+        if (!ShapeFits(board, kind, x, y, dim)) continue;
+
+        int id = static_cast<int>(shapes.size()) + 1;
+        char outline = colors[rng() % 3];
+        if (kind == ShapeKind::Line) {
+            shapes.push_back(Information(id, kind, x, y, dim, 0, outline));
         }
-        else if (type == "triangle") {
-            Triangle* triangle = new Triangle(dim1);
-            triangle->draw(board, x, y, outline, fill, true);
-            shapes.push_back(triangle);
-            shapes_info.emplace_back(id, type, x, y, dim1, dim2, outline, fill);
+        else {
+            shapes.push_back(Information(id, kind, x, y, dim, 0, outline, colors[rng() % 3], rng() % 2 == 0));
         }
-        shape_id = std::max(shape_id, id + 1);
     }
-
-    file.close();
+    return shapes;
 }
 
-char Color(const std::string& color) {
-    if (color == "red") return 'R';
-    if (color == "blue") return 'B';
-    if (color == "green") return 'G';
-    std::cerr << "This color is absent\n";
-    return '*';
+long long PeakRssKib() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return static_cast<long long>(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
 }
 
-void Edit(Board& board, std::vector<Shape*>& shapes, std::vector<Information>& shapes_info) {
-    int id;
-    std::cout << "Enter the ID of the shape you want to edit: ";
-    std::cin >> id;
+struct BenchResult {
+    const char* scene;
+    int width;
+    int height;
+    size_t shapes;
+    const char* phase;
+    int reps;
+    double ns_per_shape;
+    double cells_per_sec;
+    double allocations;
+    double allocated_bytes;
+    long long peak_rss_kib;
+};
 
-    auto info_loop = std::find_if(shapes_info.begin(), shapes_info.end(), [id](const Information& info) {
-        return info.id == id;
-        });
+// Runs setup then body until at least BENCH_MIN_SECONDS of body time has been spent, and reports
+// per-run averages. Only body is timed and counted.
+template <typename Setup, typename Body>
+BenchResult MeasurePhase(const char* phase, size_t shapes, double cells, Setup setup, Body body) {
+    const double BENCH_MIN_SECONDS = 0.2;
+    const int BENCH_MAX_REPS = 1000;
 
-    if (info_loop == shapes_info.end()) {
-        std::cout << "This shape was not found";
-        return;
+    double seconds = 0;
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    int reps = 0;
+    while (reps < BENCH_MAX_REPS && (reps == 0 || seconds < BENCH_MIN_SECONDS)) {
+        setup();
+        uint64_t count_before = allocation_counters.allocations.load(std::memory_order_relaxed);
+        uint64_t bytes_before = allocation_counters.bytes.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto stop = std::chrono::steady_clock::now();
+        allocations += allocation_counters.allocations.load(std::memory_order_relaxed) - count_before;
+        allocated_bytes += allocation_counters.bytes.load(std::memory_order_relaxed) - bytes_before;
+        seconds += std::chrono::duration<double>(stop - start).count();
+        ++reps;
     }
 
-    Information& info = *info_loop;
+    BenchResult result = {};
+    result.phase = phase;
+    result.shapes = shapes;
+    result.reps = reps;
+    double per_rep = seconds / reps;
+    result.ns_per_shape = shapes ? per_rep * 1e9 / shapes : 0;
+    result.cells_per_sec = cells > 0 && per_rep > 0 ? cells / per_rep : 0;
+    result.allocations = static_cast<double>(allocations) / reps;
+    result.allocated_bytes = static_cast<double>(allocated_bytes) / reps;
+    result.peak_rss_kib = PeakRssKib();
+    return result;
+}
+
+void BenchBoard(BenchScene kind, int size, ThreadPool& pool, uint32_t seed, std::vector<BenchResult>& results) {
+    Board board(size, size);
+    Scene scene(board);
+    std::vector<Information> shapes = GenerateScene(kind, board, seed);
 
-    std::cout << "1. Type of the figure: " << info.type << "\n";
-    std::cout << "2. X coordinate: " << info.x << "\n";
-    std::cout << "3. Y coordinate: " << info.y << "\n";
-    std::cout << "4. Width of a figure " << info.width << "\n";
-    if (info.type != "circle") {
-        std::cout << "5. Height of the figure: " << info.height << "\n";
+    double footprint_cells = 0;
+    for (const Information& info : shapes) {
+        Rect bounds = ShapeBounds(info.type, info.x, info.y, info.width).intersected(board.bounds());
+        if (!bounds.empty()) footprint_cells += static_cast<double>(bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0);
     }
-    std::cout << "6. Outline of the figure: " << info.outline << "\n";
-    std::cout << "7. Fill of the figure: " << info.fill << "\n";
+    double board_cells = static_cast<double>(size) * size;
 
-    int property;
-    std::cout << "Which property do you want to edit? ";
-    std::cin >> property;
+    size_t first = results.size();
+    results.push_back(MeasurePhase("place", shapes.size(), 0,
+        [&] { scene.clear(); scene.rebuildIndex(board); },
+        [&] {
+            for (const Information& info : shapes) {
+                if (PlaceShape(board, info, scene)) scene.add(info);
+            }
+        }));
+    std::vector<Information> batch;
+    std::vector<PlaceResult> place_results;
+    std::vector<int> placed_slots;
+    results.push_back(MeasurePhase("place_bulk", shapes.size(), 0,
+        [&] { scene.clear(); scene.rebuildIndex(board); batch = shapes; },
+        [&] {
+            int next_id = 1;
+            InsertShapes(board, scene, batch, next_id, place_results, placed_slots);
+        }));
+    results.push_back(MeasurePhase("draw", shapes.size(), footprint_cells,
+        [&] { board.clear(); },
+        [&] {
+            Canvas canvas(board);
+            for (const Information& info : shapes) DrawShape(canvas, info);
+        }));
+    results.push_back(MeasurePhase("redraw_serial", scene.size(), board_cells, [] {},
+        [&] { RedrawAllSerial(board, scene); }));
+    results.push_back(MeasurePhase("redraw_tiled", scene.size(), board_cells, [] {},
+        [&] { RedrawAllTiled(board, scene, pool); }));
 
-    switch (property) {
-    case 2: {
-        int updatedX;
-        std::cout << "Enter new X coordinate for a figure: ";
-        std::cin >> updatedX;
+    // The shapes column counts picks here: the topmost shape at each of a fixed set of cells.
+    std::mt19937 rng(seed);
+    std::vector<std::pair<int, int>> cells(4096);
+    for (auto& cell : cells) cell = { static_cast<int>(rng() % size), static_cast<int>(rng() % size) };
+    std::vector<int> found;
+    results.push_back(MeasurePhase("pick", cells.size(), 0, [] {},
+        [&] {
+            for (const auto& cell : cells) scene.shapesAt(cell.first, cell.second, false, found);
+        }));
 
-        if (updatedX >= 0 && updatedX + info.width < BOARD_WIDTH && (info.type != "circle" || info.height == 0)) {
-            info.x = updatedX;
-        }
-        else {
-            std::cout << "Wrong coordinate\n";
-        }
-        break;
+    const std::string text_file = "shapes_bench.tmp.txt";
+    const std::string binary_file = "shapes_bench.tmp.bin";
+    int shape_id = 1;
+    results.push_back(MeasurePhase("save_text", scene.size(), 0, [] {},
+        [&] { saveToFile(text_file, board, scene); }));
+    results.push_back(MeasurePhase("load_text", scene.size(), 0, [] {},
+        [&] { loadFromFile(text_file, board, scene, shape_id); }));
+    results.push_back(MeasurePhase("save_binary", scene.size(), 0, [] {},
+        [&] { saveToFile(binary_file, board, scene); }));
+    results.push_back(MeasurePhase("load_binary", scene.size(), 0, [] {},
+        [&] { loadFromFile(binary_file, board, scene, shape_id); }));
+    std::remove(text_file.c_str());
+    std::remove(binary_file.c_str());
+
+    for (size_t i = first; i < results.size(); ++i) {
+        results[i].scene = BenchSceneName(kind);
+        results[i].width = size;
+        results[i].height = size;
     }
-    case 3: {
-        int updatedY;
-        std::cout << "Enter new Y coordinate for a figure: ";
-        std::cin >> updatedY;
+}
 
-        if (updatedY >= 0 && updatedY + info.height < BOARD_HEIGHT) {
-            info.y = updatedY;
-        }
-        else {
-            std::cout << "Wrong coordinate\n";
+// The per-cell rasterizers that came before the row-span ones, kept as the reference --selftest
+// holds those to. Every cell goes through Canvas::set, so clipping is the canvas's alone.
+struct ReferenceRaster {
+    static void circle(const Canvas& canvas, int X, int Y, int radius, char outline, char fill, bool fillInside) {
+        if (radius <= 0) return;
+
+        for (int y = -radius; y <= radius; ++y) {
+            for (int x = -radius; x <= radius; ++x) {
+                float correctY = y * FIGURE_SCALE;
+                float distance = sqrt(x * x + correctY * correctY);
+                if (std::abs(distance - radius) <= 0.5) {
+                    canvas.set(X + x, Y + y, outline);
+                }
+                else if (fillInside && distance < radius) {
+                    canvas.set(X + x, Y + y, fill);
+                }
+            }
         }
-        break;
     }
-    case 4: {
-        int updatedDim;
-        std::cout << "Enter new width of a figure: ";
-        std::cin >> updatedDim;
 
-        if (updatedDim > 0) {
-            info.width = updatedDim;
-        }
-        else {
-            std::cout << "Wrong height\n";
+    static void square(const Canvas& canvas, int X, int Y, int side_length, char outline, char fill, bool fillInside) {
+        if (side_length <= 0) return;
+
+        for (int y = 0; y < side_length; ++y) {
+            float correctY = y / FIGURE_SCALE;
+
+            for (int x = 0; x < side_length; ++x) {
+                if (fillInside || y == 0 || y == side_length - 1 || x == 0 || x == side_length - 1) {
+                    int drawnX = X + x;
+                    int drawnY = Y + static_cast<int>(correctY);
+                    if (fillInside && y > 0 && y < side_length - 1 && x > 0 && x < side_length - 1) {
+                        canvas.set(drawnX, drawnY, fill);
+                    }
+                    else {
+                        canvas.set(drawnX, drawnY, outline);
+                    }
+                }
+            }
         }
-        break;
     }
-    case 5: {
-        if (info.type != "circle") {
-            int updatedHeight;
-            std::cout << "Enter new height of a figure ";
-            std::cin >> updatedHeight;
 
-            if (updatedHeight > 0) {
-                info.height = updatedHeight;
+    static void triangle(const Canvas& canvas, int x, int y, int height, char outline, char fill, bool fillInside) {
+        if (height <= 0) return;
+        for (int i = 0; i < height; ++i) {
+            int left = x - i;
+            int right = x + i;
+            int posY = y + i;
+
+            if (fillInside) {
+                for (int fillX = left; fillX <= right; ++fillX) {
+                    canvas.set(fillX, posY, fill);
+                }
             }
             else {
-                std::cout << "Invalid Height\n";
+                canvas.set(left, posY, outline);
+                if (left != right)
+                    canvas.set(right, posY, outline);
             }
         }
-        else {
-            std::cout << "Circles don't have height\n";
-        }
-        break;
-    }
-    case 6: {
-        std::string updatedOutlineColor;
-        std::cout << "Enter a new outline color (red, green, blue): ";
-        std::cin >> updatedOutlineColor;
 
-        char newOutlineCharColor = Color(updatedOutlineColor);
-        if (newOutlineCharColor != '*') {
-            info.outline = newOutlineCharColor;
-        }
-        else {
-            std::cout << "Unsupported outline color\n";
+        for (int j = 0; j < 2 * height - 1; ++j) {
+            int baseX = x - height + 1 + j;
+            int baseY = y + height - 1;
+            canvas.set(baseX, baseY, outline);
         }
-        break;
     }
-    case 7: {
-        std::string updatedFillColor;
-        std::cout << "Enter a new fill color (red, green, blue): ";
-        std::cin >> updatedFillColor;
 
-        char newFillCharColor = Color(updatedFillColor);
-        if (newFillCharColor != '*') {
-            info.fill = newFillCharColor;
-        }
-        else {
-            std::cout << "You cannot use this fill color\n";
+    static void line(const Canvas& canvas, int X, int Y, int length, char outline) {
+        for (int x = 0; x < length; ++x) {
+            canvas.set(X + x, Y, outline);
         }
-        break;
-    }
-    default:
-        std::cout << "You did not choose a correct property\n";
-        return;
     }
 
-    board.clear();
-    for (size_t i = 0; i < shapes.size(); ++i) {
-        shapes[i]->draw(board, shapes_info[i].x, shapes_info[i].y, shapes_info[i].outline, shapes_info[i].fill);
+    static void draw(const Canvas& canvas, const Information& info) {
+        switch (info.type) {
+        case ShapeKind::Circle: circle(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+        case ShapeKind::Square: square(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+        case ShapeKind::Triangle: triangle(canvas, info.x, info.y, info.width, info.outline, info.fill, info.filled); break;
+        case ShapeKind::Line: line(canvas, info.x, info.y, info.width, info.outline); break;
+        }
     }
+};
 
-    std::cout << "This shape was updated\n";
-}
+// --selftest: draws shapes of every kind with DrawShape and with ReferenceRaster and compares the
+// boards cell by cell, then checks each byte-fill routine against the scalar one. Sizes run from
+// 0 past the circle table, and a few circles go past the integer-arithmetic limit. Anchors sit
+// inside the board, on its edges and partly off it, and each case is drawn again under a random
+// clip rect. Prints the first few mismatches; returns 1 if there were any.
+int RunSelfTest() {
+    const int MAX_REPORTED = 10;
+    const char outline = Color("red");
+    const char fill = Color("blue");
+    std::mt19937 rng(12345);
+    long long cases = 0;
+    long long mismatches = 0;
+    std::vector<char> expected_row, actual_row;
 
-void Move(Board& board, std::vector<Shape*>& shapes, std::vector<Information>& shapes_info) {
-    int id, updatedX, updatedY;
-    std::cout << "Enter the ID of the shape you want to move: ";
-    std::cin >> id;
+    auto check = [&](Board& expected, Board& actual, const Information& info, const Rect& clip) {
+        expected.clear();
+        actual.clear();
+        ReferenceRaster::draw(Canvas(expected, clip), info);
+        DrawShape(Canvas(actual, clip), info);
+        ++cases;
+        expected_row.resize(expected.width);
+        actual_row.resize(actual.width);
+        for (int y = 0; y < expected.height; ++y) {
+            expected.readRow(y, 0, expected.width, expected_row.data());
+            actual.readRow(y, 0, actual.width, actual_row.data());
+            if (expected_row == actual_row) continue;
+            int x = static_cast<int>(std::mismatch(expected_row.begin(), expected_row.end(), actual_row.begin()).first - expected_row.begin());
+            if (mismatches < MAX_REPORTED) {
+                std::printf("mismatch: %s size %d at (%d, %d)%s, clip (%d, %d)-(%d, %d): cell (%d, %d) is '%c', expected '%c'\n",
+                    KindName(info.type), info.width, info.x, info.y, info.filled ? " filled" : "",
+                    clip.x0, clip.y0, clip.x1, clip.y1, x, y,
+                    ColorEntry(actual_row[x]).glyph, ColorEntry(expected_row[x]).glyph);
+            }
+            ++mismatches;
+            return;
+        }
+    };
 
-    auto it_info = std::find_if(shapes_info.begin(), shapes_info.end(), [id](const Information& info) {
-        return info.id == id;
-        });
+    Board expected(160, 100);
+    Board actual(160, 100);
+    const int W = expected.width;
+    const int H = expected.height;
+    for (int kind = 0; kind < SHAPE_KIND_COUNT; ++kind) {
+        for (int size = 0; size <= SHAPES_CIRCLE_TABLE_RADIUS + 6; ++size) {
+            const int xs[] = { W / 2, 0, size, W - 1 - size, W - 1, -size / 2, W - size / 2 };
+            const int ys[] = { H / 2, 0, H - 1, -size / 3, H - size / 3 };
+            for (int x : xs) {
+                for (int y : ys) {
+                    for (bool filled : { false, true }) {
+                        Information info(1, static_cast<ShapeKind>(kind), x, y, size, 0, outline, fill, filled);
+                        check(expected, actual, info, expected.bounds());
+                        int x0 = static_cast<int>(rng() % W), y0 = static_cast<int>(rng() % H);
+                        Rect clip = { x0, y0, x0 + 1 + static_cast<int>(rng() % (W - x0)), y0 + 1 + static_cast<int>(rng() % (H - y0)) };
+                        check(expected, actual, info, clip);
+                    }
+                }
+            }
+        }
+    }
 
-    if (it_info == shapes_info.end()) {
-        std::cout << "This shape was not found \n";
-        return;
+    const int radii[] = { 200, CIRCLE_EXACT_RADIUS - 1, CIRCLE_EXACT_RADIUS, CIRCLE_EXACT_RADIUS + 1, 1500, 2000 };
+    Board large_expected(2 * 2000 + 1, 2000 / FIGURE_SCALE * 2 + 1);
+    Board large_actual(large_expected.width, large_expected.height);
+    for (int radius : radii) {
+        for (bool filled : { false, true }) {
+            Information info(1, ShapeKind::Circle, large_expected.width / 2, large_expected.height / 2, radius, 0, outline, fill, filled);
+            check(large_expected, large_actual, info, large_expected.bounds());
+        }
     }
 
-    Information& info = *it_info;
+    long long fill_mismatches = 0;
+#ifdef SHAPES_X86
+    std::vector<FillBytesFn> fills = { FillBytesSse2 };
+    if (CpuHasAvx2()) fills.push_back(FillBytesAvx2);
+    char expected_bytes[256], actual_bytes[256];
+    for (FillBytesFn fill_bytes : fills) {
+        for (size_t offset = 0; offset < 4; ++offset) {
+            for (size_t count = 0; count + offset <= 200; ++count) {
+                std::memset(expected_bytes, '.', sizeof(expected_bytes));
+                std::memset(actual_bytes, '.', sizeof(actual_bytes));
+                FillBytesScalar(expected_bytes + offset, count, 'x');
+                fill_bytes(actual_bytes + offset, count, 'x');
+                if (std::memcmp(expected_bytes, actual_bytes, sizeof(expected_bytes)) != 0) ++fill_mismatches;
+            }
+        }
+    }
+#endif
 
-    std::cout << "Enter new coordinates for the shape: ";
-    std::cin >> updatedX >> updatedY;
+    std::printf("selftest: %lld rasterizer cases, %lld mismatches; %lld byte-fill mismatches\n", cases, mismatches, fill_mismatches);
+    return mismatches == 0 && fill_mismatches == 0 ? 0 : 1;
+}
 
-    bool canMove = false;
-    if (info.type == "circle") {
-        Circle temp_circle(info.width);
-        canMove = temp_circle.Fits(updatedX, updatedY);
-    }
-    else if (info.type == "square") {
-        Square temp_square(info.width);
-        canMove = temp_square.Fits(updatedX, updatedY);
-    }
-    else if (info.type == "triangle") {
-        Triangle temp_triangle(info.width);
-        canMove = temp_triangle.Fits(updatedX, updatedY);
-    }
+// --bench: times placement, rasterization, full redraws and save/load for every synthetic scene
+// on square boards of each size, and writes one row per (scene, size, phase) as JSON or CSV.
+int RunBenchmark(const std::string& format, const std::vector<int>& sizes, int threads) {
+    const uint32_t seed = 12345;
+    ThreadPool pool(threads);
+    std::vector<BenchResult> results;
 
-    if (!canMove) {
-        std::cout << "You cannot place this shape outside of the board \n";
-        return;
+    // Placement prints a message for every rejected shape; keep that out of the report.
+    std::streambuf* console = std::cout.rdbuf();
+    std::ostringstream discard;
+    std::cout.rdbuf(discard.rdbuf());
+    for (int size : sizes) {
+        for (BenchScene scene : { BenchScene::Uniform, BenchScene::Clustered, BenchScene::Overlap, BenchScene::LargeRadius }) {
+            BenchBoard(scene, size, pool, seed, results);
+            discard.str("");
+        }
     }
+    std::cout.rdbuf(console);
 
-    for (const auto& other_info : shapes_info) {
-        if (other_info.id != id && other_info.x == updatedX && other_info.y == updatedY) {
-            std::cout << "Another shape is already placed here \n";
-            return;
+    if (format == "csv") {
+        std::printf("scene,width,height,shapes,phase,reps,ns_per_shape,cells_per_sec,allocations,allocated_bytes,peak_rss_kib\n");
+        for (const BenchResult& r : results) {
+            std::printf("%s,%d,%d,%zu,%s,%d,%.1f,%.0f,%.1f,%.0f,%lld\n", r.scene, r.width, r.height, r.shapes, r.phase,
+                r.reps, r.ns_per_shape, r.cells_per_sec, r.allocations, r.allocated_bytes, r.peak_rss_kib);
         }
     }
-
-    info.x = updatedX;
-    info.y = updatedY;
-
-    board.clear();
-    for (size_t i = 0; i < shapes.size(); ++i) {
-        shapes[i]->draw(board, shapes_info[i].x, shapes_info[i].y, shapes_info[i].outline, shapes_info[i].fill);
+    else {
+        std::printf("{\"seed\": %u, \"threads\": %d, \"results\": [\n", seed, pool.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult& r = results[i];
+            std::printf("  {\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"shapes\": %zu, \"phase\": \"%s\", \"reps\": %d, "
+                "\"ns_per_shape\": %.1f, \"cells_per_sec\": %.0f, \"allocations\": %.1f, \"allocated_bytes\": %.0f, \"peak_rss_kib\": %lld}%s\n",
+                r.scene, r.width, r.height, r.shapes, r.phase, r.reps, r.ns_per_shape, r.cells_per_sec,
+                r.allocations, r.allocated_bytes, r.peak_rss_kib, i + 1 < results.size() ? "," : "");
+        }
+        std::printf("]}\n");
     }
+    return 0;
 }
 
+int main(int argc, char* argv[]) {
+    int board_width = DEFAULT_BOARD_WIDTH;
+    int board_height = DEFAULT_BOARD_HEIGHT;
+    int render_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string batch_script;
+    std::string bench_format;
+    bool self_test = false;
+    std::string stats_file;
+    std::vector<int> bench_sizes = { 80, 1024, 4096, 16384 };
+    std::string serve_path;
+    std::string loadgen_path;
+    int loadgen_clients = 8;
+    int loadgen_operations = 10000;
+    int loadgen_writes = 20;
+    int autosave_every = 0;
+    std::string autosave_file;
+    std::string log_path;
+    size_t log_compact = DEFAULT_LOG_COMPACT;
 
-int main() {
-    Board board;
-    std::vector<Information> shapes_info;
-    std::vector<Shape*> shapes;
-    int shape_id = 1;
-
-    std::string command;
-    while (true) {
-        std::cout << "Enter a shape (circle, square, triangle, line), 'clear', or 'exit': ";
-        std::cin >> command;
-
-        if (command == "draw") {
-            board.print();
-        }
-        else if (command == "triangle") {
-            int x, y, height;
-            std::string outlineColor, fillColor, fillInput;
-            bool fill;
-            std::cout << "Enter the location of the triangle, its height, outline color, fill color, and if it should be filled (yes or no): ";
-            std::cin >> x >> y >> height >> outlineColor >> fillColor >> fillInput;
-            fill = (fillInput == "yes");
-            Shape* triangle = new Triangle(height);
-            if (PlaceShape(x, y, triangle, shapes_info, "triangle", height)) {
-                triangle->draw(board, x, y, Color(outlineColor), Color(fillColor), fill);
-                shapes_info.emplace_back(shape_id++, "triangle", x, y, height, 0, Color(outlineColor), Color(fillColor));
-                shapes.push_back(triangle);
-            }
-            else {
-                delete triangle;
-            }
-        }
-        if (command == "circle") {
-            int x, y, radius;
-            std::string outlineColor, fillColor, fillInput;
-            bool fill;
-            std::cout << "Enter the location of the circle, its radius, outline color, fill color, and if it should be filled (yes or no): ";
-            std::cin >> x >> y >> radius >> outlineColor >> fillColor >> fillInput;
-            fill = (fillInput == "yes");
-            Shape* circle = new Circle(radius);
-            if (PlaceShape(x, y, circle, shapes_info, "circle", radius)) {
-                circle->draw(board, x, y, Color(outlineColor), Color(fillColor), fill);
-                shapes_info.emplace_back(shape_id++, "circle", x, y, radius, 0, Color(outlineColor), Color(fillColor));
-                shapes.push_back(circle);
-            }
-            else {
-                delete circle;
-            }
-        }
-        else if (command == "square") {
-            int x, y, side;
-            std::string outlineColor, fillColor, fillInput;
-            bool fill;
-            std::cout << "Enter the location of the square, its side length, outline color, fill color, and if it should be filled (yes or no): ";
-            std::cin >> x >> y >> side >> outlineColor >> fillColor >> fillInput;
-            fill = (fillInput == "yes");
-            Shape* square = new Square(side);
-            if (PlaceShape(x, y, square, shapes_info, "square", side)) {
-                square->draw(board, x, y, Color(outlineColor), Color(fillColor), fill);
-                shapes_info.emplace_back(shape_id++, "square", x, y, side, 0, Color(outlineColor), Color(fillColor));
-                shapes.push_back(square);
-            }
-            else {
-                delete square;
-            }
+    // Usage: [--batch script|-] [--bench [json|csv]] [--bench-sizes n,n,...] [--selftest] [--threads n]
+    //        [--stats-file path] [--storage auto|dense|tiled] [--autosave changes file]
+    //        [--wal path [--wal-compact records]] [--serve socket]
+    //        [--loadgen socket [--clients n] [--ops n] [--writes percent]] [width height [threads]]
+    std::vector<const char*> positional;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--selftest") == 0) {
+            self_test = true;
         }
-        else if (command == "line") {
-            int x, y, length;
-            std::string outlineColor;
-            std::cout << "Enter the location of the line, its length, and its color: ";
-            std::cin >> x >> y >> length >> outlineColor;
-            Shape* line = new Line(length);
-            if (PlaceShape(x, y, line, shapes_info, "line", length)) {
-                line->draw(board, x, y, Color(outlineColor), '*');
-                shapes_info.emplace_back(shape_id++, "line", x, y, length, 0, Color(outlineColor));
-                shapes.push_back(line);
-            }
-            else {
-                delete line;
+        else if (std::strcmp(argv[i], "--bench") == 0) {
+            bench_format = "json";
+            if (i + 1 < argc && (std::strcmp(argv[i + 1], "json") == 0 || std::strcmp(argv[i + 1], "csv") == 0)) {
+                bench_format = argv[++i];
             }
         }
-        else if (command == "remove") {
-            int id;
-            std::cout << "Enter the ID of the shape to remove: ";
-            std::cin >> id;
-
-            auto it_info = std::find_if(shapes_info.begin(), shapes_info.end(), [id](const Information& info) {
-                return info.id == id;
-                });
-
-            if (it_info != shapes_info.end()) {
-                int index = std::distance(shapes_info.begin(), it_info);
-                delete shapes[index];
-                shapes.erase(shapes.begin() + index);
-                shapes_info.erase(it_info);
-
-                board.clear();
-                for (size_t i = 0; i < shapes.size(); ++i) {
-                    shapes[i]->draw(board, shapes_info[i].x, shapes_info[i].y, shapes_info[i].outline, shapes_info[i].fill);
+        else if (std::strcmp(argv[i], "--bench-sizes") == 0 && i + 1 < argc) {
+            bench_sizes.clear();
+            std::stringstream list(argv[++i]);
+            std::string item;
+            while (std::getline(list, item, ',')) {
+                int size = std::atoi(item.c_str());
+                if (size < 16) {
+                    std::cerr << "Benchmark board sizes must be at least 16\n";
+                    return 1;
                 }
-                std::cout << "Shape removed.\n";
+                bench_sizes.push_back(size);
             }
+        }
+        else if (std::strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            stats_file = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "auto") storage_mode = StorageMode::Auto;
+            else if (mode == "dense") storage_mode = StorageMode::Dense;
+            else if (mode == "tiled") storage_mode = StorageMode::Tiled;
             else {
-                std::cout << "No shape with ID " << id << " found.\n";
-            }
-        }
-        else if (command == "paint") {
-            int id;
-            std::string color, fillColor;
-            std::cout << "Enter shape's ID, outline color, and fill color: ";
-            std::cin >> id >> color >> fillColor;
-
-            char new_outline_color = Color(color);
-            char new_fill_color = Color(fillColor);
-            bool found = false;
-
-            for (auto& info : shapes_info) {
-                if (info.id == id) {
-                    found = true;
-                    info.outline = new_outline_color;
-                    info.fill = new_fill_color;
-                    board.clear();
-                    for (size_t i = 0; i < shapes.size(); ++i) {
-                        shapes[i]->draw(board, shapes_info[i].x, shapes_info[i].y, shapes_info[i].outline, shapes_info[i].fill);
-                    }
-                    break;
-                }
+                std::cerr << "--storage takes auto, dense or tiled\n";
+                return 1;
             }
-
-            if (!found) {
-                std::cout << "Shape with ID " << id << " not found.\n";
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            render_threads = std::atoi(argv[++i]);
+            if (!ValidThreadCount(render_threads)) {
+                std::cerr << "Thread count must be from 1 to " << MaxRenderThreads() << "\n";
+                return 1;
             }
         }
-        else if (command == "save") {
-            std::string filename;
-            std::cout << "Enter the filename: ";
-            std::cin >> filename;
-            saveToFile(filename, shapes_info);
+        else if (std::strcmp(argv[i], "--autosave") == 0 && i + 2 < argc) {
+            autosave_every = std::atoi(argv[++i]);
+            autosave_file = argv[++i];
+            if (autosave_every <= 0) {
+                std::cerr << "--autosave needs a positive number of changes\n";
+                return 1;
+            }
         }
-        else if (command == "load") {
-            std::string filename;
-            std::cout << "Enter the filename: ";
-            std::cin >> filename;
-            loadFromFile(filename, board, shapes, shapes_info, shape_id);
+        else if (std::strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+            log_path = argv[++i];
         }
-        else if (command == "clear") {
-            board.clear();
-            shapes_info.clear();
-            for (auto shape : shapes) {
-                delete shape;
+        else if (std::strcmp(argv[i], "--wal-compact") == 0 && i + 1 < argc) {
+            int records = std::atoi(argv[++i]);
+            if (records <= 0) {
+                std::cerr << "--wal-compact needs a positive number of records\n";
+                return 1;
             }
-            shapes.clear();
+            log_compact = static_cast<size_t>(records);
         }
-        else if (command == "exit") {
-            break;
+        else if (std::strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
         }
-        else if (command == "undo") {
-            if (!shapes.empty()) {
-                board.clear();
-                delete shapes.back();
-                shapes.pop_back();
-                shapes_info.pop_back();
-
-                for (size_t i = 0; i < shapes.size(); ++i) {
-                    const auto& info = shapes_info[i];
-                    Shape* shape = shapes[i];
-                    shape->draw(board, info.x, info.y, info.outline, info.fill);
-                }
-            }
+        else if (std::strcmp(argv[i], "--loadgen") == 0 && i + 1 < argc) {
+            loadgen_path = argv[++i];
         }
-        else if (command == "list") {
-            for (const auto& info : shapes_info) {
-                if (info.type == "circle") {
-                    std::cout << "> " << info.id << " " << info.type << " radius: " << info.width << "\n";
-                    std::cout << "coordinates: (" << info.x << ", " << info.y << ")\n";
-                }
-                else if (info.type == "square") {
-                    std::cout << "> " << info.id << " " << info.type << " width: " << info.width << " height: " << info.height << "\n";
-                    std::cout << "coordinates: (" << info.x << ", " << info.y << ")\n";
-                }
-                else if (info.type == "triangle") {
-                    std::cout << "> " << info.id << " " << info.type << " height: " << info.width << "\n";
-                    std::cout << "coordinates: (" << info.x << ", " << info.y << ")\n";
-                }
+        else if ((std::strcmp(argv[i], "--clients") == 0 || std::strcmp(argv[i], "--ops") == 0) && i + 1 < argc) {
+            int& target = argv[i][2] == 'c' ? loadgen_clients : loadgen_operations;
+            target = std::atoi(argv[++i]);
+            if (target <= 0) {
+                std::cerr << argv[i - 1] << " must be positive\n";
+                return 1;
             }
         }
-        else if (command == "shapes") {
-            std::cout << "circle coordinates radius\n";
-            std::cout << "square coordinates side size\n";
-            std::cout << "triangle coordinates height\n";
-        }
-        else if (command == "select") {
-            int id;
-            std::cout << "Enter ID of the figure you want to check: ";
-            std::cin >> id;
-
-            bool found = false;
-
-            for (const auto& info : shapes_info) {
-                if (info.id == id) {
-                    found = true;
-                    std::cout << info.type << " " << info.x << " " << info.y << " " << info.width << " ";
-                    if (info.type != "circle") {
-                        std::cout << info.height << " ";
-                    }
-                    std::cout << "Outline Color: " << info.outline << ", Fill Color: " << info.fill;
-                    break;
-                }
+        else if (std::strcmp(argv[i], "--writes") == 0 && i + 1 < argc) {
+            loadgen_writes = std::atoi(argv[++i]);
+            if (loadgen_writes < 0 || loadgen_writes > 100) {
+                std::cerr << "--writes takes a percentage from 0 to 100\n";
+                return 1;
             }
-
-            if (!found) {
-                std::cout << "Could not find this figure";
+        }
+        else if (std::strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "--batch needs a script file, or - for stdin\n";
+                return 1;
             }
+            batch_script = argv[++i];
+        }
+        else {
+            positional.push_back(argv[i]);
         }
-        else if (command == "edit") {
-            Edit(board, shapes, shapes_info);
+    }
+
+    if (positional.size() >= 2) {
+        board_width = std::atoi(positional[0]);
+        board_height = std::atoi(positional[1]);
+        if (!ValidBoardSize(board_width, board_height)) {
+            std::cerr << "Board size must be from 1 to " << MAX_BOARD_SIDE << " on each side\n";
+            return 1;
         }
-        else if (command == "move") {
-            Move(board, shapes, shapes_info);
+    }
+    if (positional.size() >= 3) {
+        render_threads = std::atoi(positional[2]);
+        if (!ValidThreadCount(render_threads)) {
+            std::cerr << "Thread count must be from 1 to " << MaxRenderThreads() << "\n";
+            return 1;
         }
     }
 
-    for (auto shape : shapes) {
-        delete shape;
+    if (self_test) {
+        return RunSelfTest();
+    }
+    if (!bench_format.empty()) {
+        return RunBenchmark(bench_format, bench_sizes, render_threads);
     }
 
-    return 0;
+#ifdef _WIN32
+    if (!serve_path.empty() || !loadgen_path.empty()) {
+        std::cerr << "--serve and --loadgen need Unix domain sockets, which this build does not support\n";
+        return 1;
+    }
+#else
+    if (!loadgen_path.empty()) {
+        return RunLoadGenerator(loadgen_path, loadgen_clients, loadgen_operations, loadgen_writes, board_width, board_height);
+    }
+#endif
+
+    Session session(board_width, board_height, render_threads);
+    session.autosave_every = autosave_every;
+    session.autosave_file = autosave_file;
+    if (!log_path.empty() && !OpenLog(session, log_path, log_compact)) return 1;
+    int status = 0;
+    if (!serve_path.empty()) {
+#ifndef _WIN32
+        status = RunServer(session, serve_path);
+#endif
+    }
+    else if (!batch_script.empty()) {
+        status = RunBatch(session, batch_script);
+    }
+    else {
+        RunInteractive(session);
+    }
+
+    if (!stats_file.empty()) {
+        std::ofstream out(stats_file);
+        if (out) WriteStats(out);
+        else std::cerr << "Could not write statistics to " << stats_file << "\n";
+    }
+    return status;
 }